@@ -0,0 +1,70 @@
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+
+#ifndef DEQUE_BLOCKING_QUEUE_H
+#define DEQUE_BLOCKING_QUEUE_H
+
+// Bounded multi-producer multi-consumer queue.
+// After close() pushes fail and pops drain what is left, then fail.
+template<class T>
+class blocking_queue {
+    std::deque<T> data;
+    const size_t capacity;
+    bool closed = false;
+    std::mutex lock;
+    std::condition_variable not_empty, not_full;
+
+public:
+    explicit blocking_queue(size_t capacity = std::numeric_limits<size_t>::max());
+
+    blocking_queue(const blocking_queue &) = delete;
+
+    bool push(T &&object);
+
+    bool pop(T &object);
+
+    void close();
+};
+
+template<class T>
+blocking_queue<T>::blocking_queue(size_t capacity):capacity(capacity) {
+}
+
+template<class T>
+bool blocking_queue<T>::push(T &&object) {
+    std::unique_lock<std::mutex> guard(lock);
+    not_full.wait(guard, [this] { return closed || data.size() < capacity; });
+    if (closed) {
+        return false;
+    }
+    data.push_back(std::move(object));
+    not_empty.notify_one();
+
+    return true;
+}
+
+template<class T>
+bool blocking_queue<T>::pop(T &object) {
+    std::unique_lock<std::mutex> guard(lock);
+    not_empty.wait(guard, [this] { return closed || !data.empty(); });
+    if (data.empty()) {
+        return false;
+    }
+    object = std::move(data.front());
+    data.pop_front();
+    not_full.notify_one();
+
+    return true;
+}
+
+template<class T>
+void blocking_queue<T>::close() {
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+}
+
+#endif //DEQUE_BLOCKING_QUEUE_H
@@ -75,6 +75,135 @@ namespace deque_test {
         cout << "------ All correct -------\n";
     }
 
+    void test_persistence() {
+        cout << "------- Persistence --------\n";
+
+        const string name = "persistence";
+        std::deque<int> native_deque;
+        {
+            dumb_external_deque<int> dumb_deque(root, name);
+            for (size_t i = 0; i < size_equals; ++i) {
+                native_deque.push_back(i);
+                dumb_deque.push_back(i);
+                native_deque.push_front(i);
+                dumb_deque.push_front(i);
+            }
+            native_deque.pop_back();
+            dumb_deque.pop_back();
+        }
+
+        dumb_external_deque<int> dumb_deque(root, name);
+        assert(native_deque.size() == dumb_deque.size());
+
+        auto it_dumb = dumb_deque.begin();
+        for (auto it_native = native_deque.begin(); it_native != native_deque.end(); ++it_native, ++it_dumb) {
+            assert(*it_native == *it_dumb);
+        }
+
+        while (native_deque.size() != 0) {
+            assert(native_deque.front() == *dumb_deque.begin());
+            native_deque.pop_front();
+            dumb_deque.pop_front();
+        }
+        assert(dumb_deque.size() == 0);
+
+        // FIFO use drains the back segment from its head: the file must be compacted, not grow
+        const size_t window = 1000, steps = 4 * 1024 * 1024 / sizeof(int);
+        {
+            dumb_external_deque<int> dumb_deque(root, name);
+            for (size_t i = 0; i < window; ++i) {
+                dumb_deque.push_back(i);
+            }
+            for (size_t i = window; i < window + steps; ++i) {
+                dumb_deque.pop_front();
+                dumb_deque.push_back(i);
+            }
+            dumb_deque.sync();
+        }
+        struct stat st;
+        assert(stat((root + separator() + name + "databack").c_str(), &st) == 0);
+        assert(static_cast<size_t>(st.st_size) < steps * sizeof(int));
+        {
+            dumb_external_deque<int> dumb_deque(root, name);
+            assert(dumb_deque.size() == window);
+            int expected = steps;
+            for (auto it = dumb_deque.begin(); it != dumb_deque.end(); ++it, ++expected) {
+                assert(*it == expected);
+            }
+        }
+
+        for (auto suffix : {"front", "back", "journal"}) {
+            std::remove((root + separator() + name + "data" + suffix).c_str());
+        }
+
+        cout << "------ All correct -------\n";
+    }
+
+    // sorting spans several blocks, merging takes in a deque that is shorter than a block
+    void test_sort() {
+        cout << "------- Sort --------\n";
+        const size_t count = 5000000;
+        std::vector<int> expected, merged;
+        external_deque<int> ext_deque(root), another(root);
+        ext_deque.sort(std::less<int>(), 32 * 1024 * 1024, sort_context({root}));
+        ext_deque.merge_from(another, std::less<int>());
+        assert(ext_deque.size() == 0 && another.size() == 0);
+        for (size_t i = 0; i < count; ++i) {
+            expected.push_back(rand());
+            if (i % 3 == 0) {
+                ext_deque.push_front(expected.back());
+            } else {
+                ext_deque.push_back(expected.back());
+            }
+        }
+        // a budget below one block is refused and the deque stays usable
+        bool refused = false;
+        try {
+            ext_deque.sort(std::less<int>(), 4 * 1024 * 1024, sort_context({root}));
+        } catch (const std::runtime_error &) {
+            refused = true;
+        }
+        assert(refused && ext_deque.size() == count);
+        ext_deque.push_back(-1);
+        ext_deque.push_front(-1);
+        ext_deque.pop_back();
+        ext_deque.pop_front();
+        ext_deque.sort(std::less<int>(), 32 * 1024 * 1024, sort_context({root}));
+        std::sort(expected.begin(), expected.end());
+        assert(ext_deque.size() == count);
+        auto it_expected = expected.begin();
+        auto end = ext_deque.end();
+        for (auto it_ext = ext_deque.begin(); it_ext != end; ++it_ext, ++it_expected) {
+            assert(*it_ext == *it_expected);
+        }
+
+        for (size_t i = 0; i < size_equals; ++i) {
+            merged.push_back(rand());
+        }
+        std::sort(merged.begin(), merged.end());
+        for (auto object : merged) {
+            another.push_back(object);
+        }
+        ext_deque.merge_from(another, std::less<int>());
+        std::vector<int> both(expected.size() + merged.size());
+        std::merge(expected.begin(), expected.end(), merged.begin(), merged.end(), both.begin());
+        assert(another.size() == 0 && ext_deque.size() == both.size());
+        ext_deque.merge_from(another, std::less<int>());
+        assert(ext_deque.size() == both.size());
+
+        ext_deque.push_front(-1);
+        ext_deque.push_back(-2);
+        assert(*ext_deque.begin() == -1);
+        ext_deque.pop_front();
+        for (auto &object : both) {
+            assert(*ext_deque.begin() == object);
+            ext_deque.pop_front();
+        }
+        assert(*ext_deque.begin() == -2);
+
+        cout << "------ All correct -------\n";
+    }
+
     template<class T>
     void test_one(T &deq) {
         clock_t start = clock();
@@ -154,6 +283,8 @@ namespace deque_test {
         root = path;
         size = val;
         test_correctness();
+        test_persistence();
+        test_sort();
         test_performance();
     }
 
@@ -12,20 +12,50 @@
 #define DEQUE_DUMB_EXTERNAL_DEQUE_H
 using std::string;
 
+// Log-structured deque: every element lives on disk, each operation costs O(1) I/O.
+// push_back appends to the back segment, push_front appends to the front segment
+// (which stores elements in reverse order), pops only move the persisted offsets.
+// A named deque survives a clean shutdown; against a crash it is only as durable as the
+// last sync(): the journal is rewritten on every operation, but segment data and journal
+// reach the disk in that order only there, so later offsets may point at unwritten data.
 template <class T>
 class dumb_external_deque {
     static constexpr size_t block_size = 2 * 1024 * 1024 / sizeof(T);
     const string prefix;
     static const string delimiter;
-    size_t left_size = 0, right_size = 0, left_edge = 0, right_edge = 0;
+
+    // live elements of a segment are [head, tail)
+    struct segment {
+        int fd = -1;
+        size_t head = 0, tail = 0;
+
+        size_t size() const {
+            return tail - head;
+        }
+    };
+
+    segment front_segment, back_segment;
+    int journal = -1;
+    bool persistent = false;
     mpz_class data_size;
 
+    void open_files();
+    void save_offsets();
+
+    void append(segment& seg, const T& object);
+    void cut_tail(segment& seg);
+    void cut_head(segment& seg);
+    void reset(segment& seg);
+    void compact(segment& seg);
+    void sync_file(int fd, const string& suffix);
 
 public:
 
     class iterator;
 
     dumb_external_deque(const string& root);
+    // reopens (or creates) the journal called name, its files are kept after destruction
+    dumb_external_deque(const string& root, const string& name);
     dumb_external_deque(const dumb_external_deque& ) = delete;
 
     void push_back(const T& object);
@@ -36,50 +66,46 @@ public:
 
     mpz_class size() const;
 
+    // flushes segment data and then the journal, so the saved offsets never outrun the data
+    void sync();
+
     dumb_external_deque<T>::iterator begin();
     dumb_external_deque<T>::iterator end();
 
     ~dumb_external_deque();
 };
 
+// reads ahead through its own buffers, so it is invalidated by any modification of the deque
 template <class T>
 class dumb_external_deque<T>::iterator {
-    size_t shift, block_num, block_size;
-    const string prefix;
+    const dumb_external_deque<T> *host;
+    size_t position;
+    buffered_reader<T> front_reader, back_reader;
 public:
 
-    iterator(size_t block_num, size_t shift, const string& prefix):block_num(block_num),shift(shift),prefix(prefix){
-	block_size = get_file_length<T>(prefix + std::to_string(block_num));
-}
+    iterator(size_t position, const dumb_external_deque<T> *host):host(host),position(position),
+            front_reader(host->front_segment.fd), back_reader(host->back_segment.fd){}
 
     iterator& operator++() {
-        if (block_size <= shift + 1) {
-            shift = 0;
-            ++block_num;
-	    block_size = get_file_length<T>(prefix + std::to_string(block_num));
-        } else {
-            ++shift;
-        }
+        ++position;
         return *this;
     }
 
     iterator& operator--() {
-        if (shift <= 0) {
-            --block_num;
-	    block_size = get_file_length<T>(prefix + std::to_string(block_num));
-	    shift = block_size - 1;
-        } else {
-            --shift;
-        }
+        --position;
         return *this;
     }
 
     T operator*() {
-        return get_from_file<T>(prefix + std::to_string(block_num) , shift);
+        auto &front = host->front_segment;
+        if (position < front.size()) {
+            return front_reader.read(front.tail - 1 - position);
+        }
+        return back_reader.read(host->back_segment.head + position - front.size());
     }
 
     bool operator==(const iterator& another) {
-        return block_num == another.block_num && shift == another.shift;
+        return position == another.position;
     }
 
     bool operator!=(const iterator& another) {
@@ -92,70 +118,145 @@ const string dumb_external_deque<T>::delimiter = "data";
 
 template <class T>
 dumb_external_deque<T>::dumb_external_deque(const string &root):prefix(root + separator() + std::to_string(
-        reinterpret_cast<intptr_t>(this))){
+        reinterpret_cast<intptr_t>(this)) + delimiter){
+    open_files();
+    save_offsets();
 }
 
 template <class T>
-void dumb_external_deque<T>::push_front(const T &object) {
-    if (left_size + 1 == block_size) {
-        --left_edge;
-        left_size = 0;
+dumb_external_deque<T>::dumb_external_deque(const string &root, const string &name):prefix(root + separator() +
+        name + delimiter), persistent(true){
+    open_files();
+
+    std::array<size_t, 4> offsets;
+    if (pread(journal, offsets.data(), sizeof(offsets), 0) == sizeof(offsets)) {
+        front_segment.head = offsets[0];
+        front_segment.tail = offsets[1];
+        back_segment.head = offsets[2];
+        back_segment.tail = offsets[3];
     } else {
-        ++left_size;
-        if (left_edge == right_edge) {
-            ++right_size;
+        save_offsets();
+    }
+    data_size = front_segment.size() + back_segment.size();
+}
+
+template <class T>
+void dumb_external_deque<T>::open_files() {
+    front_segment.fd = open((prefix + "front").c_str(), O_RDWR | O_CREAT, 0644);
+    back_segment.fd = open((prefix + "back").c_str(), O_RDWR | O_CREAT, 0644);
+    journal = open((prefix + "journal").c_str(), O_RDWR | O_CREAT, 0644);
+    if (front_segment.fd < 0 || back_segment.fd < 0 || journal < 0) {
+        throw std::runtime_error("Can't open files " + prefix);
+    }
+}
+
+template <class T>
+void dumb_external_deque<T>::save_offsets() {
+    std::array<size_t, 4> offsets = {front_segment.head, front_segment.tail, back_segment.head, back_segment.tail};
+    if (pwrite(journal, offsets.data(), sizeof(offsets), 0) != sizeof(offsets)) {
+        throw std::runtime_error("Can't write to file " + prefix + "journal");
+    }
+}
+
+template <class T>
+void dumb_external_deque<T>::append(segment &seg, const T &object) {
+    write_to_descriptor(seg.fd, seg.tail++, object);
+}
+
+template <class T>
+void dumb_external_deque<T>::cut_tail(segment &seg) {
+    --seg.tail;
+    if (seg.tail == seg.head) {
+        reset(seg);
+    } else if (seg.tail % block_size == 0) {
+        ftruncate(seg.fd, seg.tail * sizeof(T));
+    }
+}
+
+template <class T>
+void dumb_external_deque<T>::cut_head(segment &seg) {
+    ++seg.head;
+    if (seg.tail == seg.head) {
+        reset(seg);
+    } else if (seg.head % block_size == 0) {
+        punch_hole(seg.fd, (seg.head - block_size) * sizeof(T), block_size * sizeof(T));
+        if (seg.head >= seg.size()) {
+            compact(seg);
+        }
+    }
+}
+
+// moves the live elements to the start of the file once the drained prefix outgrows them,
+// so offsets stay bounded under FIFO use; the copy is paid for by the pops since the last one
+template <class T>
+void dumb_external_deque<T>::compact(segment &seg) {
+    const string suffix = &seg == &front_segment ? "front" : "back";
+    std::vector<byte> buffer;
+    for (size_t from = seg.head; from < seg.tail; from += block_size) {
+        size_t bytes = std::min(seg.tail - from, size_t(block_size)) * sizeof(T);
+        buffer.resize(bytes);
+        if (pread(seg.fd, buffer.data(), bytes, from * sizeof(T)) != static_cast<ssize_t>(bytes)) {
+            throw std::runtime_error("Can't read from file " + prefix + suffix);
         }
+        if (pwrite(seg.fd, buffer.data(), bytes, (from - seg.head) * sizeof(T)) != static_cast<ssize_t>(bytes)) {
+            throw std::runtime_error("Can't write to file " + prefix + suffix);
+        }
+    }
+    // the old copy is dropped only once the journal points at the new one
+    if (persistent) {
+        sync_file(seg.fd, suffix);
     }
-    add_to_file_begin(prefix + delimiter + std::to_string(left_edge), object);
+    seg.tail -= seg.head;
+    seg.head = 0;
+    save_offsets();
+    if (persistent) {
+        sync_file(journal, "journal");
+    }
+    ftruncate(seg.fd, seg.tail * sizeof(T));
+}
+
+template <class T>
+void dumb_external_deque<T>::reset(segment &seg) {
+    seg.head = seg.tail = 0;
+    ftruncate(seg.fd, 0);
+}
+
+template <class T>
+void dumb_external_deque<T>::push_front(const T &object) {
+    append(front_segment, object);
+    save_offsets();
 
     ++data_size;
 }
 
 template <class T>
 void dumb_external_deque<T>::push_back(const T &object) {
-    if (right_size + 1 == block_size) {
-        ++right_edge;
-        right_size = 0;
-    } else {
-        ++right_size;
-        if (left_edge == right_edge) {
-            ++left_size;
-        }
-    }
-    add_to_file_end(prefix + delimiter + std::to_string(right_edge), object);
+    append(back_segment, object);
+    save_offsets();
 
     ++data_size;
 }
+
 template <class T>
 void dumb_external_deque<T>::pop_back() {
-    remove_from_file<T>(prefix + delimiter + std::to_string(right_edge), true);
-    if (right_size == 0) {
-        std::remove((prefix + delimiter + std::to_string(right_edge)).c_str());
-        --right_edge;
-        right_size = block_size - 1;
+    if (back_segment.size() != 0) {
+        cut_tail(back_segment);
     } else {
-        --right_size;
-        if (left_edge == right_edge) {
-            --left_size;
-        }
+        cut_head(front_segment);
     }
+    save_offsets();
 
     --data_size;
 }
 
 template <class T>
 void dumb_external_deque<T>::pop_front() {
-    remove_from_file<T>(prefix + delimiter + std::to_string(left_edge), false);
-    if (left_size == 0) {
-        std::remove((prefix + delimiter + std::to_string(left_edge)).c_str());
-        ++left_edge;
-        left_size= block_size - 1;
+    if (front_segment.size() != 0) {
+        cut_tail(front_segment);
     } else {
-        --left_size;
-        if (left_edge == right_edge) {
-            --right_size;
-        }
+        cut_head(back_segment);
     }
+    save_offsets();
 
     --data_size;
 }
@@ -165,20 +266,44 @@ mpz_class dumb_external_deque<T>::size() const {
     return data_size;
 }
 
+template <class T>
+void dumb_external_deque<T>::sync_file(int fd, const string &suffix) {
+    if (fdatasync(fd) != 0) {
+        throw std::runtime_error("Can't sync file " + prefix + suffix);
+    }
+}
+
+template <class T>
+void dumb_external_deque<T>::sync() {
+    sync_file(front_segment.fd, "front");
+    sync_file(back_segment.fd, "back");
+    sync_file(journal, "journal");
+}
+
 template <class T>
 typename dumb_external_deque<T>::iterator dumb_external_deque<T>::begin() {
-    return dumb_external_deque<T>::iterator(left_edge, 0, prefix + delimiter);
+    return dumb_external_deque<T>::iterator(0, this);
 }
 
 template <class T>
 typename dumb_external_deque<T>::iterator dumb_external_deque<T>::end() {
-    return dumb_external_deque<T>::iterator(right_edge+1, 0, prefix + delimiter);
+    return dumb_external_deque<T>::iterator(front_segment.size() + back_segment.size(), this);
 }
 
 template <class T>
 dumb_external_deque<T>::~dumb_external_deque() {
-    for (auto i  = left_edge; i != right_edge + 1; ++i) {
-        std::remove((prefix + delimiter + std::to_string(i)).c_str());
+    if (persistent) {
+        fdatasync(front_segment.fd);
+        fdatasync(back_segment.fd);
+        fdatasync(journal);
+    }
+    close(front_segment.fd);
+    close(back_segment.fd);
+    close(journal);
+    if (!persistent) {
+        std::remove((prefix + "front").c_str());
+        std::remove((prefix + "back").c_str());
+        std::remove((prefix + "journal").c_str());
     }
 }
 
@@ -2,6 +2,7 @@
 #include <gmpxx.h>
 #include <string>
 #include "util.h"
+#include "msort.h"
 #include <memory>
 #include <map>
 
@@ -27,6 +28,14 @@ class external_deque {
 
     void drop(unsigned number);
 
+    std::vector<string> save_blocks();
+
+    void detach();
+
+    void attach(unsigned blocks);
+
+    void discard(unsigned blocks, bool detached);
+
 public:
 
     class iterator;
@@ -45,6 +54,17 @@ public:
 
     mpz_class size() const;
 
+    // Sorts the elements by comp within memory_size bytes: every block is sorted as a run, then the runs are
+    // merged back into the block files. Iterators are invalidated. If it throws, the elements are kept as they were.
+    template<class Comp>
+    void sort(Comp comp, unsigned long memory_size, const sort_context &context = sort_context());
+
+    // Moves the elements of another deque into this one, both sorted by comp, keeping the order;
+    // a block of each and one of the output are held at once. Iterators of both are invalidated.
+    // If it throws, both deques are kept as they were.
+    template<class Comp>
+    void merge_from(external_deque &another, Comp comp);
+
     external_deque<T>::iterator begin();
 
     external_deque<T>::iterator end();
@@ -218,6 +238,91 @@ mpz_class external_deque<T>::size() const {
     return data_size;
 }
 
+template<class T>
+template<class Comp>
+void external_deque<T>::sort(Comp comp, unsigned long memory_size, const sort_context &context) {
+    if (size() == 0) {
+        return;
+    }
+    auto &&files = save_blocks();
+    unsigned blocks = 0;
+    bool detached = false;
+    try {
+        msort_detail::sort_block_files<T>(files, memory_size, block_size * sizeof(T) / 8, comp, block_size - 1,
+                                          [this, &detached]() {
+                                              detach();
+                                              detached = true;
+                                          },
+                                          [this, &blocks](const std::vector<T> &data) {
+                                              save_block(prefix + "sorted" + std::to_string(left_edge + blocks++),
+                                                         data);
+                                          }, context);
+    } catch (...) {
+        discard(blocks, detached);
+        throw;
+    }
+    attach(blocks);
+}
+
+template<class T>
+template<class Comp>
+void external_deque<T>::merge_from(external_deque &another, Comp comp) {
+    if (&another == this || another.size() == 0) {
+        return;
+    }
+    auto &&files = save_blocks(), &&another_files = another.save_blocks();
+    detach();
+    another.detach();
+    std::vector<T> first, second, output;
+    size_t first_file = 0, second_file = 0, first_position = 0, second_position = 0;
+    // loads the next nonempty block of files, false when they are over
+    auto refill = [](const std::vector<string> &files, size_t &file, std::vector<T> &data, size_t &position) {
+        while (position == data.size() && file != files.size()) {
+            load_block(files[file++], data);
+            position = 0;
+        }
+        return position != data.size();
+    };
+    unsigned blocks = 0;
+    auto emit = [this, &output, &blocks](const T &object) {
+        output.push_back(object);
+        if (output.size() == block_size - 1) {
+            save_block(prefix + "sorted" + std::to_string(left_edge + blocks++), output);
+            output.clear();
+        }
+    };
+
+    try {
+        output.reserve(block_size - 1);
+        while (refill(files, first_file, first, first_position) &&
+               refill(another_files, second_file, second, second_position)) {
+            if (comp(second[second_position], first[first_position])) {
+                emit(second[second_position++]);
+            } else {
+                emit(first[first_position++]);
+            }
+        }
+        while (refill(files, first_file, first, first_position)) {
+            emit(first[first_position++]);
+        }
+        while (refill(another_files, second_file, second, second_position)) {
+            emit(second[second_position++]);
+        }
+        if (!output.empty()) {
+            save_block(prefix + "sorted" + std::to_string(left_edge + blocks++), output);
+        }
+    } catch (...) {
+        discard(blocks, true);
+        another.discard(0, true);
+        throw;
+    }
+
+    data_size += another.data_size;
+    another.data_size = 0;
+    another.attach(0);
+    attach(blocks);
+}
+
 template<class T>
 typename external_deque<T>::iterator external_deque<T>::begin() {
     auto tmp = (left_block->size() == 0) ? left_edge + 1 : left_edge;
@@ -261,6 +366,61 @@ void external_deque<T>::drop(unsigned number) {
     }
 }
 
+// Saves the loaded blocks, which stay loaded, and returns the names of the block files in order.
+template<class T>
+std::vector<string> external_deque<T>::save_blocks() {
+    for (auto &block : loaded_blocks) {
+        if (block.first - left_edge <= right_edge - left_edge) {
+            std::vector<T> buffer(block.second.second.begin(), block.second.second.end());
+            save_block(prefix + std::to_string(block.first), buffer);
+        }
+    }
+
+    std::vector<string> files;
+    for (unsigned i = left_edge; i != right_edge + 1; ++i) {
+        files.push_back(prefix + std::to_string(i));
+    }
+    return files;
+}
+
+// Unloads the blocks saved by save_blocks, the ones out of the edges are empty and go away.
+template<class T>
+void external_deque<T>::detach() {
+    for (auto &block : loaded_blocks) {
+        if (block.first - left_edge > right_edge - left_edge) {
+            std::remove((prefix + std::to_string(block.first)).c_str());
+        }
+    }
+    loaded_blocks.clear();
+    left_block = right_block = left_block_next = right_block_next = nullptr;
+}
+
+// The sorted block files written from left_edge on replace the old block files.
+template<class T>
+void external_deque<T>::attach(unsigned blocks) {
+    for (unsigned i = left_edge; i != left_edge + blocks; ++i) {
+        msort_detail::rename_file(prefix + "sorted" + std::to_string(i), prefix + std::to_string(i));
+    }
+    for (unsigned i = left_edge + blocks; i - left_edge <= right_edge - left_edge; ++i) {
+        std::remove((prefix + std::to_string(i)).c_str());
+    }
+    right_edge = blocks == 0 ? left_edge : left_edge + blocks - 1;
+    left_block = upload(left_edge);
+    right_block = upload(right_edge);
+}
+
+// Removes the sorted block files written so far and loads the old edges again after a failure.
+template<class T>
+void external_deque<T>::discard(unsigned blocks, bool detached) {
+    for (unsigned i = left_edge; i != left_edge + blocks; ++i) {
+        std::remove((prefix + "sorted" + std::to_string(i)).c_str());
+    }
+    if (detached) {
+        left_block = upload(left_edge);
+        right_block = upload(right_edge);
+    }
+}
+
 template<class T>
 external_deque<T>::~external_deque() {
     for (unsigned i = left_edge - 1; i != right_edge + 2; ++i) {
@@ -1,9 +1,27 @@
 #include "sort_test.h"
 #include "deque_test.h"
 
+int inspect(const string &file_name) {
+    block_header header;
+    if (!read_block_header(file_name, header)) {
+        std::cout << file_name << ": no block header, " << get_raw_file_length(file_name) << " raw bytes\n";
+        return 1;
+    }
+    std::cout << file_name << ": version " << header.version << ", element size " << header.element_size
+              << ", count " << header.count << ", codec " << header.codec
+              << ", payload at " << header.payload_offset << "\n";
+    bool valid = verify_block(file_name);
+    std::cout << "Checksum " << (valid ? "ok" : "mismatch") << "\n";
+    return valid ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
+    if (argc == 3 && string(argv[1]) == "inspect") {
+        return inspect(argv[2]);
+    }
     if (argc < 4) {
         std::cout << "Usage: [deque|sort] [path_to_root] [size]\n";
+        std::cout << "       inspect [block_file]\n";
         return 1;
     }
     string root(argv[2]);
@@ -16,4 +34,4 @@ int main(int argc, char *argv[]) {
     } else {
         return 1;
     }
-}
\ No newline at end of file
+}
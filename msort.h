@@ -5,7 +5,21 @@
 
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
 #include "util.h"
+#include "blocking_queue.h"
+#include "radix_sort.h"
+#include "sorting_network.h"
+#include "run_codec.h"
 
 namespace {
 
@@ -28,7 +42,7 @@ namespace {
 
     template<class T, class Comp>
     void merge(T it_begin, T it_end, T ws, Comp &comp) {
-        if (it_end - it_begin <= 1) {
+        if (it_end - it_begin <= 1 || small_sort(it_begin, it_end, comp)) {
             return;
         }
         auto middle = (it_end - it_begin) >> 1;
@@ -43,70 +57,702 @@ namespace {
             std::swap(*(ws++), *(it_begin++));
         }
     }
-    const string prefix = "externalsortblock#";
+}
+
+namespace msort_detail {
+    // Tournament tree over k sorted sources: internal nodes keep the loser of their match,
+    // so replacing the winner replays only its path to the root, log k comparisons.
+    // A null head marks an exhausted source, a tree over no sources is exhausted from the start.
     template<class T, class Comp>
-    std::vector<string> split_and_sort(const string& file_name, unsigned long block_size, Comp comp) {
+    class loser_tree {
+        size_t k;
+        std::vector<size_t> tree;
+        std::vector<const T *> heads;
+        Comp comp;
+
+        // ties go to the smaller index to keep the merge stable
+        bool beats(size_t a, size_t b) const {
+            if (heads[b] == nullptr) {
+                return true;
+            }
+            if (heads[a] == nullptr) {
+                return false;
+            }
+            return comp(*heads[a], *heads[b]) || (!comp(*heads[b], *heads[a]) && a < b);
+        }
+
+        size_t build(size_t node) {
+            if (node >= k) {
+                return node - k;
+            }
+            size_t left = build(node << 1), right = build((node << 1) + 1);
+            if (beats(left, right)) {
+                tree[node] = right;
+                return left;
+            }
+            tree[node] = left;
+            return right;
+        }
+
+    public:
+        loser_tree(const std::vector<const T *> &heads, Comp comp) : k(heads.size()), tree(heads.size() + 1),
+                                                                       heads(heads), comp(comp) {
+            tree[0] = k == 0 ? 0 : build(1);
+        }
+
+        size_t winner() const {
+            return tree[0];
+        }
+
+        const T *top() const {
+            return k == 0 ? nullptr : heads[tree[0]];
+        }
 
+        void replace_top(const T *head) {
+            size_t current = tree[0];
+            heads[current] = head;
+            for (size_t node = (current + k) >> 1; node > 0; node >>= 1) {
+                if (beats(tree[node], current)) {
+                    std::swap(tree[node], current);
+                }
+            }
+            tree[0] = current;
+        }
+    };
 
-        std::ifstream fin(file_name, std::ios::binary | std::ios::ate);
-        std::streamsize size = fin.tellg();
-        fin.seekg(0, std::ios::beg);
-        std::vector<byte> vec;
+    // block of a run stored at offset of a file of a scratch file set
+    struct extent {
+        size_t disk;
+        size_t offset;
+        size_t count;
+    };
+
+    // sorted run stored as consecutive blocks
+    using run = std::vector<extent>;
+
+    // Holds runs of a sort as block extents in one file per scratch directory, the files
+    // are removed after the sort unless they are persistent. Run number n is stored on disk n
+    // modulo the file count. Blocks are encoded by run_codec if compress is set, extents keep the raw size.
+    class scratch_file {
         std::vector<string> names;
-        unsigned long position = 0;
-        block_size -= block_size % sizeof(T);
-        vec.resize(block_size);
-        while (position < size) {
-            if (size - position < block_size) {
-                block_size = size - position;
-                vec.resize(block_size);
+        std::vector<int> fds;
+        std::vector<size_t> ends;
+        const bool compress;
+        bool persistent = false;
+
+    public:
+        // reopen keeps the runs already stored in the files
+        explicit scratch_file(const std::vector<string> &names, bool compress = false, bool reopen = false)
+                : names(names), ends(names.size(), 0), compress(compress) {
+            for (auto &name : names) {
+                int fd = open(name.c_str(), O_RDWR | O_CREAT | (reopen ? 0 : O_TRUNC), 0644);
+                if (fd < 0) {
+                    for (size_t disk = 0; disk < fds.size(); ++disk) {
+                        close(fds[disk]);
+                        std::remove(names[disk].c_str());
+                    }
+                    throw std::runtime_error("Can't open file " + name);
+                }
+                fds.push_back(fd);
+            }
+        }
+
+        scratch_file(const scratch_file &) = delete;
+
+        int descriptor(size_t disk) const {
+            return fds[disk];
+        }
+
+        // saves block.count elements into block
+        template<class T>
+        void write(const extent &block, const T *data) const {
+            write_run_block_at(fds[block.disk], block.offset, data, block.count, compress);
+        }
+
+        template<class T>
+        void read(const extent &block, std::vector<T> &answer) const {
+            read_run_block_at(fds[block.disk], block.offset, block.count, answer);
+        }
+
+        // place for the next block of run number run_number
+        extent allocate(size_t run_number, size_t count, size_t element_size) {
+            size_t disk = run_number % fds.size();
+            extent answer{disk, ends[disk], count};
+            ends[disk] += block_extent_size(count, element_size);
+            return answer;
+        }
+
+        // allocates space of size bytes upfront, spread evenly, so the runs are laid out contiguously
+        void reserve(size_t size) {
+            for (int fd : fds) {
+                posix_fallocate(fd, 0, size / fds.size() + block_header::page_size);
             }
-            //todo : make default class for loading parts of file, add possibility to pass custom loader
-            if (!fin.read( vec.data(), block_size)) {
-                throw std::runtime_error("Can't read from file " + file_name );
+        }
+
+        // returns the space of a consumed block to the file system, unless the runs are persistent
+        void release(const extent &block, size_t element_size) {
+            if (!persistent) {
+                punch_hole(fds[block.disk], block.offset, block_extent_size(block.count, element_size));
             }
-            size_t counter = 0;
-            std::array<byte, sizeof(T)> buffer;
-            std::vector<T> answer;
-            T example;
+        }
+
+        // Persistent files outlive the object and keep consumed blocks, so the runs written
+        // before a checkpoint can be merged again after a failure.
+        void persist(bool keep) {
+            persistent = keep;
+        }
 
-            while (counter < vec.size()) {
-                for (auto iter = buffer.begin(); iter != buffer.end(); ++iter) {
-                    (*iter) = vec[counter++];
+        // flushes the written runs to the disks
+        void sync() {
+            for (size_t disk = 0; disk < fds.size(); ++disk) {
+                if (fdatasync(fds[disk]) != 0) {
+                    throw std::runtime_error("Can't sync file " + names[disk]);
                 }
-                answer.push_back(from_bytes(buffer, example));
             }
-            std::sort(answer.begin(), answer.end(), comp);
-            names.push_back(prefix + std::to_string(names.size()));
-            save_block(names.back(), answer);
+        }
 
-            position += block_size;
+        const std::vector<string> &file_names() const {
+            return names;
         }
 
-        return names;
-    }
+        void clear() {
+            for (size_t disk = 0; disk < fds.size(); ++disk) {
+                ftruncate(fds[disk], 0);
+                ends[disk] = 0;
+            }
+        }
+
+        ~scratch_file() {
+            for (size_t disk = 0; disk < fds.size(); ++disk) {
+                close(fds[disk]);
+                if (!persistent) {
+                    std::remove(names[disk].c_str());
+                }
+            }
+        }
+    };
+
+    // Bytes a sort may hold at once. Buffers are leased from it before they are allocated,
+    // so a plan that doesn't fit fails instead of overshooting the memory limit.
+    class memory_budget {
+        const unsigned long limit;
+        std::atomic<unsigned long> used, peak;
+
+    public:
+        // returns its bytes to the budget when destroyed
+        class lease {
+            memory_budget *budget = nullptr;
+            unsigned long bytes = 0;
+
+        public:
+            lease() = default;
+
+            lease(memory_budget *budget, unsigned long bytes) : budget(budget), bytes(bytes) {}
+
+            lease(lease &&another) : budget(another.budget), bytes(another.bytes) {
+                another.budget = nullptr;
+            }
+
+            lease &operator=(lease &&another) {
+                std::swap(budget, another.budget);
+                std::swap(bytes, another.bytes);
+                return *this;
+            }
+
+            // takes more bytes from the same budget
+            void grow(unsigned long more) {
+                lease extra = budget->acquire(more);
+                extra.budget = nullptr;
+                bytes += more;
+            }
+
+            ~lease() {
+                if (budget != nullptr) {
+                    budget->used -= bytes;
+                }
+            }
+        };
+
+        explicit memory_budget(unsigned long limit) : limit(limit), used(0), peak(0) {}
+
+        memory_budget(const memory_budget &) = delete;
+
+        lease acquire(unsigned long bytes) {
+            unsigned long current = used.load();
+            do {
+                if (current + bytes > limit) {
+                    throw std::runtime_error("Can't fit " + std::to_string(bytes) +
+                                             " more bytes into memory budget of " + std::to_string(limit));
+                }
+            } while (!used.compare_exchange_weak(current, current + bytes));
+            unsigned long highest = peak.load();
+            while (highest < current + bytes && !peak.compare_exchange_weak(highest, current + bytes)) {
+            }
+            return lease(this, bytes);
+        }
+
+        unsigned long available() const {
+            return limit - used.load();
+        }
+
+        unsigned long peak_usage() const {
+            return peak.load();
+        }
+    };
+
+    // absorb(accumulated, next) folds next into the previous output element and returns true
+    // if they are to be combined; elements arrive in sorted order
+    struct no_combine {
+        template<class T>
+        bool operator()(T &, const T &) const {
+            return false;
+        }
+    };
 
-    void merge_blocks(const string& file_name, const std::vector<string>& names) {
-        std::ofstream fout(file_name, std::ios::out);
-        for (auto it = names.begin(); it != names.end(); ++it) {
-            auto raw_data = load_raw_block(*it);
-            std::remove((*it).c_str());
-            fout.write(raw_data.data(), raw_data.size());
+    // collapses neighbours of a sorted chunk with absorb
+    template<class T, class Absorb>
+    void combine_sorted(std::vector<T> &data, const Absorb &absorb) {
+        if (data.empty()) {
+            return;
+        }
+        size_t last = 0;
+        for (size_t i = 1; i < data.size(); ++i) {
+            if (!absorb(data[last], data[i])) {
+                data[++last] = std::move(data[i]);
+            }
         }
-        fout.close();
+        data.resize(last + 1);
+    }
+
+    // Buffer sizes of an external sort, chosen by plan_sort
+    struct sort_plan {
+        // bytes of an I/O block, a multiple of the element size
+        unsigned long block_size;
+        // bytes of a run formed by split_and_sort, a multiple of block_size
+        unsigned long run_size;
+        // sorter threads and chunks held at once by split_and_sort
+        size_t sorters, in_flight;
+        // runs merged at once
+        size_t fan_in;
+        // expected passes over the data after run formation
+        size_t passes;
+    };
+
+    // Run blocks of elements that aren't trivially copyable are (de)serialized through a copy,
+    // those of elements with a run_codec are encoded and decoded through one.
+    template<class T>
+    bool copies_blocks() {
+        return !std::is_trivially_copyable<T>::value || run_codec<T>::id != 0;
     }
-    const string temporary_prefix = "externalsorttemporary#";
+
+    // input and output blocks are kept besides the heap, and their serialization or encoding copies
+    template<class T>
+    size_t replacement_selection_blocks() {
+        return std::is_trivially_copyable<T>::value ? (copies_blocks<T>() ? 3 : 2) : 4;
+    }
+
     template<class T>
-    void save_temporary(const std::vector<T>& data, size_t suffix) {
-        save_block(temporary_prefix + std::to_string(suffix), data);
+    struct chunk {
+        size_t number;
+        std::vector<T> data;
+        memory_budget::lease memory;
+    };
+
+    // Pipelined run generation: this thread reads chunks of run_size, sorter threads sort them,
+    // a writer thread saves them block by block. Each sorter needs sorter_blocks more chunks of memory,
+    // the sorter may shrink a chunk. The input is mapped if mapped is set, see element_reader.
+    template<class T, class Sorter>
+    std::vector<run> split_and_sort(const string& file_name, const sort_plan &plan, Sorter sorter,
+                                    size_t sorter_blocks, scratch_file &scratch, memory_budget &budget,
+                                    bool mapped) {
+        element_reader<T> fin(file_name, mapped);
+        unsigned long size = get_raw_file_length(file_name);
+        const bool trivial = std::is_trivially_copyable<T>::value;
+        const size_t block_elements = plan.block_size / sizeof(T);
+        // every chunk but the last is full, so places in the scratch file are known upfront
+        std::vector<run> runs;
+        size_t reserved = 0;
+        for (unsigned long position = 0; position < size; position += plan.run_size) {
+            runs.emplace_back();
+            for (size_t left = std::min(plan.run_size, size - position) / sizeof(T); left > 0;) {
+                size_t count = std::min(left, block_elements);
+                runs.back().push_back(scratch.allocate(runs.size() - 1, count, sizeof(T)));
+                reserved += block_extent_size(count, sizeof(T));
+                left -= count;
+            }
+        }
+        scratch.reserve(reserved);
+
+        // deserialization needs a copy of a chunk, serialization a copy of a block and a header page
+        memory_budget::lease reading = budget.acquire(trivial ? 0 : plan.run_size);
+        blocking_queue<memory_budget::lease> slots(plan.in_flight);
+        blocking_queue<chunk<T>> unsorted, sorted;
+        for (size_t i = 0; i < plan.in_flight; ++i) {
+            slots.push(budget.acquire(plan.run_size));
+        }
+
+        std::exception_ptr error;
+        std::mutex error_lock;
+        auto fail = [&]() {
+            std::lock_guard<std::mutex> guard(error_lock);
+            if (!error) {
+                error = std::current_exception();
+            }
+            slots.close();
+            unsorted.close();
+            sorted.close();
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < plan.sorters; ++i) {
+            workers.emplace_back([&]() {
+                try {
+                    memory_budget::lease sorting = budget.acquire(sorter_blocks * plan.run_size);
+                    chunk<T> current;
+                    while (unsorted.pop(current)) {
+                        sorter(current.data);
+                        if (!sorted.push(std::move(current))) {
+                            break;
+                        }
+                    }
+                } catch (...) {
+                    fail();
+                }
+            });
+        }
+        std::thread writer([&]() {
+            try {
+                memory_budget::lease writing = budget.acquire((copies_blocks<T>() ? plan.block_size : 0) +
+                                                              block_header::page_size);
+                chunk<T> current;
+                while (sorted.pop(current)) {
+                    auto &blocks = runs[current.number];
+                    size_t written = 0, used = 0;
+                    for (; written < current.data.size(); ++used) {
+                        blocks[used].count = std::min(block_elements, current.data.size() - written);
+                        scratch.write(blocks[used], current.data.data() + written);
+                        written += blocks[used].count;
+                    }
+                    blocks.resize(used);
+                    current.data = std::vector<T>();
+                    slots.push(std::move(current.memory));
+                }
+            } catch (...) {
+                fail();
+            }
+        });
+
+        try {
+            memory_budget::lease slot;
+            for (size_t number = 0; number < runs.size() && slots.pop(slot); ++number) {
+                size_t count = 0;
+                for (auto &block : runs[number]) {
+                    count += block.count;
+                }
+                chunk<T> current{number, std::vector<T>(), std::move(slot)};
+                if (!fin.read(count, current.data)) {
+                    throw std::runtime_error("Can't read from file " + file_name );
+                }
+                if (!unsorted.push(std::move(current))) {
+                    break;
+                }
+            }
+        } catch (...) {
+            fail();
+        }
+
+        unsorted.close();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        sorted.close();
+        writer.join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        return runs;
     }
 
+    // Replacement selection: a heap of memory_size bytes emits the smallest element that can still
+    // extend the current run, so runs average twice the heap size on random input
+    // and sorted stretches of the input end up in a single run.
+    template<class T, class Comp, class Absorb>
+    std::vector<run> replacement_selection(const string& file_name, const sort_plan &plan, Comp comp, Absorb absorb,
+                                           scratch_file &scratch, memory_budget &budget, bool mapped) {
+        using tagged = std::pair<size_t, T>;
+        element_reader<T> fin(file_name, mapped);
+        unsigned long left = get_raw_file_length(file_name) / sizeof(T);
+        const size_t block_size = plan.block_size / sizeof(T);
+        scratch.reserve(block_extent_size(left, sizeof(T)) + (left / block_size + 1) * block_header::page_size);
+
+        memory_budget::lease blocks = budget.acquire(replacement_selection_blocks<T>() * plan.block_size +
+                                                     block_header::page_size);
+        const size_t capacity = std::max<size_t>(1, budget.available() / sizeof(tagged));
+        memory_budget::lease heap_memory = budget.acquire(capacity * sizeof(tagged));
+        auto later = [&comp](const tagged &f, const tagged &s) {
+            return f.first != s.first ? f.first > s.first : comp(s.second, f.second);
+        };
+
+        std::vector<T> input, output;
+        auto input_position = input.end();
+        auto next = [&](T &object) {
+            if (input_position == input.end()) {
+                size_t count = std::min<unsigned long>(block_size, left);
+                if (!fin.read(count, input)) {
+                    throw std::runtime_error("Can't read from file " + file_name );
+                }
+                left -= count;
+                input_position = input.begin();
+            }
+            object = *(input_position++);
+        };
+        auto has_next = [&]() {
+            return input_position != input.end() || left != 0;
+        };
+
+        std::vector<tagged> heap;
+        heap.reserve(capacity);
+        T object;
+        while (heap.size() < capacity && has_next()) {
+            next(object);
+            heap.emplace_back(0, object);
+        }
+        std::make_heap(heap.begin(), heap.end(), later);
+
+        std::vector<run> runs;
+        auto flush = [&]() {
+            if (output.size() != 0) {
+                runs.back().push_back(scratch.allocate(runs.size() - 1, output.size(), sizeof(T)));
+                scratch.write(runs.back().back(), output.data());
+                output.clear();
+            }
+        };
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            tagged &top = heap.back();
+            if (runs.size() == top.first) {
+                flush();
+                runs.emplace_back();
+            }
+            if (output.empty() || !absorb(output.back(), top.second)) {
+                if (output.size() == block_size) {
+                    flush();
+                }
+                output.push_back(top.second);
+            }
 
-    void rename_temporary(size_t limit) {
-        for (size_t i = 0; i < limit; ++i) {
-            rename((temporary_prefix + std::to_string(i)).c_str(), (prefix + std::to_string(i)).c_str());
+            if (has_next()) {
+                next(object);
+                top.first += comp(object, top.second) ? 1 : 0;
+                top.second = object;
+                std::push_heap(heap.begin(), heap.end(), later);
+            } else {
+                heap.pop_back();
+            }
         }
+        flush();
+
+        return runs;
     }
+
+    // Reads blocks of runs into buffers of the callers on one background thread, in the order requested.
+    template<class T>
+    class block_prefetcher {
+        struct read_request {
+            const scratch_file *scratch;
+            extent block;
+            std::vector<T> *answer;
+        };
+
+        std::deque<read_request> requests;
+        size_t issued = 0, done = 0;
+        bool closed = false;
+        std::exception_ptr error;
+        std::mutex lock;
+        std::condition_variable changed;
+        std::thread thread;
+
+        void work() {
+            std::unique_lock<std::mutex> guard(lock);
+            while (true) {
+                changed.wait(guard, [this] { return closed || !requests.empty(); });
+                if (requests.empty()) {
+                    return;
+                }
+                read_request current = requests.front();
+                guard.unlock();
+                std::exception_ptr failure;
+                try {
+                    current.scratch->read(current.block, *current.answer);
+                } catch (...) {
+                    failure = std::current_exception();
+                }
+                guard.lock();
+                requests.pop_front();
+                if (failure && !error) {
+                    error = failure;
+                }
+                ++done;
+                changed.notify_all();
+            }
+        }
+
+    public:
+        block_prefetcher() : thread([this] { work(); }) {
+        }
+
+        block_prefetcher(const block_prefetcher &) = delete;
+
+        // queues a read of block into answer, which is left alone until the returned ticket is waited for
+        size_t request(const scratch_file &scratch, const extent &block, std::vector<T> &answer) {
+            std::lock_guard<std::mutex> guard(lock);
+            requests.push_back(read_request{&scratch, block, &answer});
+            changed.notify_all();
+            return issued++;
+        }
+
+        // waits for the read of ticket, rethrows a failure of any read
+        void wait(size_t ticket) {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this, ticket] { return done > ticket; });
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        // waits for the read of ticket, ignoring failures
+        void settle(size_t ticket) {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this, ticket] { return done > ticket; });
+        }
+
+        ~block_prefetcher() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                closed = true;
+                changed.notify_all();
+            }
+            thread.join();
+        }
+    };
+
+    // Reads a run block by block, releasing consumed blocks; the next block is loaded by prefetcher
+    // into the second of two buffers while the current one is merged, then they are swapped.
+    template<class T>
+    class run_reader {
+        scratch_file *scratch;
+        block_prefetcher<T> *prefetcher;
+        run::const_iterator current, end;
+        std::vector<T> data, next;
+        size_t position = 0, ticket = 0;
+        bool loading = false;
+
+        void prefetch() {
+            if (current != end && current + 1 != end) {
+                ticket = prefetcher->request(*scratch, *(current + 1), next);
+                loading = true;
+            }
+        }
+
+    public:
+        run_reader(const run &blocks, scratch_file &scratch, block_prefetcher<T> &prefetcher)
+                : scratch(&scratch), prefetcher(&prefetcher), current(blocks.begin()), end(blocks.end()) {
+            if (current != end) {
+                scratch.read(*current, data);
+            }
+            prefetch();
+        }
+
+        run_reader(const run_reader &) = delete;
+
+        const T *head() const {
+            return current == end ? nullptr : data.data() + position;
+        }
+
+        // moves to the next element, nullptr at the end of the run
+        const T *advance() {
+            if (++position == data.size()) {
+                scratch->release(*current, sizeof(T));
+                if (++current == end) {
+                    return nullptr;
+                }
+                loading = false;
+                prefetcher->wait(ticket);
+                std::swap(data, next);
+                position = 0;
+                prefetch();
+            }
+            return data.data() + position;
+        }
+
+        ~run_reader() {
+            if (loading) {
+                prefetcher->settle(ticket);
+            }
+        }
+    };
+
+    // Saves blocks on a background thread while the caller fills the next one. Three buffers
+    // go around: one being filled, one queued and one being written.
+    template<class T, class Position = size_t>
+    class block_writer {
+        using block = std::pair<Position, std::vector<T>>;
+        std::function<void(const Position &, const std::vector<T> &)> save;
+        blocking_queue<block> queue;
+        blocking_queue<std::vector<T>> spare;
+        std::exception_ptr error;
+        std::thread thread;
+
+    public:
+        // save(position, data) is called on the writer thread
+        explicit block_writer(std::function<void(const Position &, const std::vector<T> &)> save)
+                : save(save), queue(1), thread([this]() {
+            try {
+                block current;
+                while (queue.pop(current)) {
+                    this->save(current.first, current.second);
+                    current.second.clear();
+                    spare.push(std::move(current.second));
+                }
+            } catch (...) {
+                error = std::current_exception();
+                queue.close();
+                spare.close();
+            }
+        }) {
+            spare.push(std::vector<T>());
+            spare.push(std::vector<T>());
+        }
+
+        block_writer(const block_writer &) = delete;
+
+        // queues data to be saved and replaces it with an empty buffer written before
+        void write(const Position &position, std::vector<T> &data) {
+            if (!queue.push(std::make_pair(position, std::move(data))) || !spare.pop(data)) {
+                finish();
+            }
+        }
+
+        // waits for all blocks to be saved, rethrows a failure of the writer thread
+        void finish() {
+            queue.close();
+            if (thread.joinable()) {
+                thread.join();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        ~block_writer() {
+            queue.close();
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    };
 }
 
 template<class T, class Comp>
@@ -133,104 +779,1876 @@ void merge_sort(T it_begin, T it_end, Comp comp) {
 
 template<class T>
 void merge_sort(T it_begin, T it_end) {
-    merge_sort(it_begin, it_end,
-               [](const decltype(*it_begin) f, const decltype(*it_begin) s) -> bool { return f < s; });
+    merge_sort(it_begin, it_end, std::less<typename std::iterator_traits<T>::value_type>());
 }
 
+namespace {
+    // runs longer than this switch the adaptive merge into galloping mode
+    const long min_gallop = 7;
 
+    // first iterator in [it_begin, it_end) for which pred fails, pred must hold for a prefix;
+    // probes 1, 2, 4, ... elements ahead, so a short prefix costs O(log) of its own length
+    template<class T, class Pred>
+    T gallop(T it_begin, T it_end, Pred pred) {
+        long low = 0, high = 1, size = it_end - it_begin;
+        while (high <= size && pred(*(it_begin + (high - 1)))) {
+            low = high;
+            high = (high << 1) + 1;
+        }
+        high = std::min(high, size);
+        while (low < high) {
+            long middle = (low + high) >> 1;
+            if (pred(*(it_begin + middle))) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return it_begin + low;
+    }
 
-template<class T, class Comp>
-void
-external_sort(const std::string &file_name, unsigned long  memory_size, unsigned long block_size, Comp comp) {
-    if (block_size < 2 * 1024 * 1024) {
-        block_size = 2 * 1024 * 1024;
+    // Ascending or strictly descending run at it_begin, descending ones are reversed
+    // (strictness keeps the sort stable). Returns the end of the run.
+    template<class T, class Comp>
+    T natural_run(T it_begin, T it_end, Comp &comp) {
+        T run_end = it_begin + 1;
+        if (run_end == it_end) {
+            return run_end;
+        }
+        if (comp(*run_end, *it_begin)) {
+            while (++run_end != it_end && comp(*run_end, *(run_end - 1))) {
+            }
+            std::reverse(it_begin, run_end);
+        } else {
+            while (++run_end != it_end && !comp(*run_end, *(run_end - 1))) {
+            }
+        }
+        return run_end;
     }
-    std::vector<std::string> names = split_and_sort<int>(file_name, block_size, comp);
 
-    auto iter = names.begin();
-    size_t count = 1;
-    const size_t blocks_count = (memory_size < 20 * 1024 * 1024 ? 20 * 1024 * 1024 : memory_size) / block_size - 1;
-    assert(blocks_count > 1);
-    block_size /= sizeof(T);
-    std::vector<T> buffer;
-    std::vector<std::vector<T>> loaded_data;
-    std::vector<decltype(names.begin())> current_iters, end_iters;
-    std::vector<decltype(buffer.begin())> current_positions;
-
-    while (count != names.size()) {
-        size_t tmp_block_counter = 0;
-        iter = names.begin();
-        while (iter < names.end()) {
-            size_t tmp_counter = 0;
-            while (tmp_counter < blocks_count && iter < names.end()) {
-                loaded_data.push_back(load_block<T>(*iter));
-                current_iters.push_back(iter);
-                current_positions.push_back(loaded_data.back().begin());
-                iter = names.end() - iter < count ? names.end() : iter + count;
-                end_iters.push_back(iter);
-                ++tmp_counter;
-            }
-
-
-            decltype(buffer.begin()) *max;
-            for (;;) {
-                max = nullptr;
-                for (size_t i = 0; i < loaded_data.size(); ++i) {
-                    if (current_iters[i] == end_iters[i]) {
-                        continue;
-                    }
+    // extends the sorted [it_begin, sorted) to [it_begin, it_end) by binary insertion
+    template<class T, class Comp>
+    void binary_insertion_sort(T it_begin, T sorted, T it_end, Comp &comp) {
+        for (; sorted != it_end; ++sorted) {
+            std::rotate(std::upper_bound(it_begin, sorted, *sorted, comp), sorted, sorted + 1);
+        }
+    }
 
-                    if (current_positions[i] == loaded_data[i].end()) {
-                        ++current_iters[i];
-                        if (current_iters[i] == end_iters[i]) {
-                            continue;
-                        }
+    // runs shorter than this are extended, so that n / min_run is close to a power of two
+    inline long adaptive_min_run(long size) {
+        long rest = 0;
+        while (size >= 64) {
+            rest |= size & 1;
+            size >>= 1;
+        }
+        return size + rest;
+    }
 
-                        loaded_data[i] = load_block<T>(*current_iters[i]);
-                        current_positions[i] = loaded_data[i].begin();
-                    }
+    // Timsort-like merge state: a stack of adjacent sorted runs and a buffer for the smaller side of a merge
+    template<class T, class Comp>
+    class run_merger {
+        using value_type = typename std::iterator_traits<T>::value_type;
 
-                    if (max == nullptr || comp(*current_positions[i], **max)) {
-                        max = &current_positions[i];
-                    }
-                }
+        struct natural {
+            T begin;
+            long size;
+        };
 
-                if (max == nullptr) {
-                    if (buffer.size() != 0) {
-                        save_temporary(buffer, tmp_block_counter++);
-                        buffer.clear();
-                    }
-                    break;
-                }
+        std::vector<natural> runs;
+        std::vector<value_type> buffer;
+        long gallop_threshold = min_gallop;
+        Comp &comp;
+
+        void merge_low(T left, T middle, T right);
+        void merge_high(T left, T middle, T right);
+        void merge_at(size_t i);
+
+    public:
+        explicit run_merger(Comp &comp):comp(comp) {}
+
+        // keeps run sizes growing faster than Fibonacci numbers from the top of the stack,
+        // merging runs of similar sizes as soon as they appear
+        void push(T begin, long size);
+
+        void collapse();
+    };
 
-                buffer.push_back(**max);
-                ++(*max);
-                if (buffer.size() == block_size) {
-                    save_temporary(buffer, tmp_block_counter++);
-                    buffer.clear();
+    template<class T, class Comp>
+    void run_merger<T, Comp>::push(T begin, long size) {
+        runs.push_back(natural{begin, size});
+        while (runs.size() > 1) {
+            size_t i = runs.size() - 2;
+            if ((i > 0 && runs[i - 1].size <= runs[i].size + runs[i + 1].size) ||
+                (i > 1 && runs[i - 2].size <= runs[i - 1].size + runs[i].size)) {
+                if (runs[i - 1].size < runs[i + 1].size) {
+                    --i;
                 }
+            } else if (runs[i].size > runs[i + 1].size) {
+                break;
+            }
+            merge_at(i);
+        }
+    }
+
+    template<class T, class Comp>
+    void run_merger<T, Comp>::collapse() {
+        while (runs.size() > 1) {
+            size_t i = runs.size() - 2;
+            if (i > 0 && runs[i - 1].size < runs[i + 1].size) {
+                --i;
             }
-            current_iters.clear();
-            current_positions.clear();
-            end_iters.clear();
-            loaded_data.clear();
+            merge_at(i);
         }
+    }
 
-        rename_temporary(tmp_block_counter);
+    // merges runs i and i + 1; elements already in place at both ends are skipped by galloping
+    template<class T, class Comp>
+    void run_merger<T, Comp>::merge_at(size_t i) {
+        T left = runs[i].begin, middle = runs[i + 1].begin, right = middle + runs[i + 1].size;
+        runs[i].size += runs[i + 1].size;
+        runs.erase(runs.begin() + i + 1);
 
-        count *= blocks_count;
-        if (count > names.size()) {
-            count = names.size();
+        left = gallop(left, middle, [&](const value_type &x) { return !comp(*middle, x); });
+        if (left == middle) {
+            return;
+        }
+        right = gallop(std::make_reverse_iterator(right), std::make_reverse_iterator(middle),
+                       [&](const value_type &x) { return !comp(x, *(middle - 1)); }).base();
+        if (middle - left <= right - middle) {
+            merge_low(left, middle, right);
+        } else {
+            merge_high(left, middle, right);
         }
     }
 
-    merge_blocks(file_name, names);
-}
+    // Merge front to back with the left run moved to the buffer. After min_gallop wins in a row
+    // by one side, whole stretches are found by galloping; the threshold adapts to how well it pays.
+    template<class T, class Comp>
+    void run_merger<T, Comp>::merge_low(T left, T middle, T right) {
+        buffer.assign(std::make_move_iterator(left), std::make_move_iterator(middle));
+        auto first = buffer.begin(), first_end = buffer.end();
+        T second = middle, dest = left;
+
+        while (first != first_end && second != right) {
+            long first_wins = 0, second_wins = 0;
+            while (first != first_end && second != right &&
+                   std::max(first_wins, second_wins) < gallop_threshold) {
+                if (comp(*second, *first)) {
+                    *(dest++) = std::move(*(second++));
+                    ++second_wins;
+                    first_wins = 0;
+                } else {
+                    *(dest++) = std::move(*(first++));
+                    ++first_wins;
+                    second_wins = 0;
+                }
+            }
+            if (first == first_end || second == right) {
+                break;
+            }
+            do {
+                auto first_stop = gallop(first, first_end, [&](const value_type &x) { return !comp(*second, x); });
+                first_wins = first_stop - first;
+                dest = std::move(first, first_stop, dest);
+                first = first_stop;
+                if (first == first_end) {
+                    break;
+                }
+                T second_stop = gallop(second, right, [&](const value_type &x) { return comp(x, *first); });
+                second_wins = second_stop - second;
+                dest = std::move(second, second_stop, dest);
+                second = second_stop;
+                gallop_threshold = std::max(gallop_threshold - 1, 1L);
+            } while (second != right && std::max(first_wins, second_wins) >= min_gallop);
+            gallop_threshold += 2;
+        }
+        std::move(first, first_end, dest);
+    }
 
+    // mirror of merge_low: the right run goes to the buffer and the merge runs back to front
+    template<class T, class Comp>
+    void run_merger<T, Comp>::merge_high(T left, T middle, T right) {
+        buffer.assign(std::make_move_iterator(middle), std::make_move_iterator(right));
+        auto second = buffer.end(), second_begin = buffer.begin();
+        T first = middle, dest = right;
 
-template<class T>
-void external_sort(const std::string &file_name, unsigned long  memory_size, unsigned long block_size) {
-    external_sort<T>(file_name, memory_size, block_size,
-                     [](const T& f, const T& s) -> bool { return f < s; });
+        while (first != left && second != second_begin) {
+            long first_wins = 0, second_wins = 0;
+            while (first != left && second != second_begin &&
+                   std::max(first_wins, second_wins) < gallop_threshold) {
+                if (comp(*(second - 1), *(first - 1))) {
+                    *(--dest) = std::move(*(--first));
+                    ++first_wins;
+                    second_wins = 0;
+                } else {
+                    *(--dest) = std::move(*(--second));
+                    ++second_wins;
+                    first_wins = 0;
+                }
+            }
+            if (first == left || second == second_begin) {
+                break;
+            }
+            do {
+                auto second_stop = gallop(std::make_reverse_iterator(second), std::make_reverse_iterator(second_begin),
+                                          [&](const value_type &x) { return !comp(x, *(first - 1)); }).base();
+                second_wins = second - second_stop;
+                dest = std::move_backward(second_stop, second, dest);
+                second = second_stop;
+                if (second == second_begin) {
+                    break;
+                }
+                T first_stop = gallop(std::make_reverse_iterator(first), std::make_reverse_iterator(left),
+                                      [&](const value_type &x) { return comp(*(second - 1), x); }).base();
+                first_wins = first - first_stop;
+                dest = std::move_backward(first_stop, first, dest);
+                first = first_stop;
+                gallop_threshold = std::max(gallop_threshold - 1, 1L);
+            } while (first != left && std::max(first_wins, second_wins) >= min_gallop);
+            gallop_threshold += 2;
+        }
+        std::move_backward(second_begin, second, dest);
+    }
 }
+
+// Stable merge sort adapting to presorted input like Timsort: natural runs (descending ones
+// reversed) are extended to a minimum length by insertion and merged with galloping.
+// Sorted or reversed input costs O(n), the buffer is at most half the range.
+template<class T, class Comp>
+void adaptive_merge_sort(T it_begin, T it_end, Comp comp) {
+    long size = it_end - it_begin;
+    if (size < 2) {
+        return;
+    }
+    const long min_run = adaptive_min_run(size);
+    run_merger<T, Comp> merger(comp);
+    for (T run_begin = it_begin; run_begin != it_end;) {
+        T run_end = natural_run(run_begin, it_end, comp);
+        if (run_end - run_begin < min_run) {
+            T extended = run_begin + std::min(min_run, it_end - run_begin);
+            binary_insertion_sort(run_begin, run_end, extended, comp);
+            run_end = extended;
+        }
+        merger.push(run_begin, run_end - run_begin);
+        run_begin = run_end;
+    }
+    merger.collapse();
+}
+
+template<class T>
+void adaptive_merge_sort(T it_begin, T it_end) {
+    adaptive_merge_sort(it_begin, it_end, std::less<typename std::iterator_traits<T>::value_type>());
+}
+
+
+namespace {
+    // below this many elements the sequential merge_sort is used
+    const long parallel_grain = 1 << 14;
+
+    // runs task(0) ... task(count - 1) on their own threads, rethrows the first failure
+    template<class F>
+    void parallel_for(size_t count, F task) {
+        std::vector<std::exception_ptr> errors(count);
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < count; ++i) {
+            workers.emplace_back([&task, &errors, i]() {
+                try {
+                    task(i);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        try {
+            task(0);
+        } catch (...) {
+            errors[0] = std::current_exception();
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        for (auto &error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    // Stable merge of [it_begin, middle) and [middle, it_end) without extra memory:
+    // the median of the longer half is rotated into its final place, both sides are merged independently.
+    template<class T, class Comp>
+    void parallel_merge_inplace(T it_begin, T middle, T it_end, Comp &comp, size_t threads) {
+        auto left = middle - it_begin, right = it_end - middle;
+        if (left == 0 || right == 0) {
+            return;
+        }
+        if (left + right == 2) {
+            if (comp(*middle, *it_begin)) {
+                std::iter_swap(it_begin, middle);
+            }
+            return;
+        }
+
+        T first_cut, second_cut;
+        if (left >= right) {
+            first_cut = it_begin + (left >> 1);
+            second_cut = std::lower_bound(middle, it_end, *first_cut, comp);
+        } else {
+            second_cut = middle + (right >> 1);
+            first_cut = std::upper_bound(it_begin, middle, *second_cut, comp);
+        }
+        T new_middle = std::rotate(first_cut, middle, second_cut);
+
+        if (threads > 1 && left + right >= parallel_grain) {
+            parallel_for(2, [&](size_t i) {
+                if (i == 0) {
+                    parallel_merge_inplace(it_begin, first_cut, new_middle, comp, threads >> 1);
+                } else {
+                    parallel_merge_inplace(new_middle, second_cut, it_end, comp, threads - (threads >> 1));
+                }
+            });
+        } else {
+            parallel_merge_inplace(it_begin, first_cut, new_middle, comp, 1);
+            parallel_merge_inplace(new_middle, second_cut, it_end, comp, 1);
+        }
+    }
+
+    template<class T, class Comp>
+    void parallel_sort_inplace(T it_begin, T it_end, Comp &comp, size_t threads) {
+        if (threads <= 1 || it_end - it_begin < parallel_grain) {
+            merge_sort(it_begin, it_end, comp);
+            return;
+        }
+        T middle = it_begin + ((it_end - it_begin) >> 1);
+        parallel_for(2, [&](size_t i) {
+            if (i == 0) {
+                parallel_sort_inplace(it_begin, middle, comp, threads >> 1);
+            } else {
+                parallel_sort_inplace(middle, it_end, comp, threads - (threads >> 1));
+            }
+        });
+        parallel_merge_inplace(it_begin, middle, it_end, comp, threads);
+    }
+
+    // number of elements of [a, a + n) among the first k elements of the stable merge with [b, b + m)
+    template<class T, class B, class Comp>
+    long co_rank(long k, T a, long n, B b, long m, Comp &comp) {
+        long low = std::max(0L, k - m), high = std::min(k, n);
+        while (low < high) {
+            long i = (low + high) >> 1, j = k - i;
+            if (j > 0 && !comp(*(b + (j - 1)), *(a + i))) {
+                low = i + 1;
+            } else {
+                high = i;
+            }
+        }
+        return low;
+    }
+
+    // O(n) scratch variant: halves are sorted in parallel, then every thread merges
+    // its share of the output, found by co-ranking, into the buffer and moves it back.
+    template<class T, class B, class Comp>
+    void parallel_sort_buffered(T it_begin, T it_end, B buffer, Comp &comp, size_t threads) {
+        long size = it_end - it_begin;
+        if (threads <= 1 || size < parallel_grain) {
+            merge_sort(it_begin, it_end, comp);
+            return;
+        }
+        long half = size >> 1;
+        T middle = it_begin + half;
+        parallel_for(2, [&](size_t i) {
+            if (i == 0) {
+                parallel_sort_buffered(it_begin, middle, buffer, comp, threads >> 1);
+            } else {
+                parallel_sort_buffered(middle, it_end, buffer + half, comp, threads - (threads >> 1));
+            }
+        });
+
+        parallel_for(threads, [&](size_t piece) {
+            long from = size * piece / threads, to = size * (piece + 1) / threads;
+            long left_from = co_rank(from, it_begin, half, middle, size - half, comp);
+            long left_to = co_rank(to, it_begin, half, middle, size - half, comp);
+            std::merge(std::make_move_iterator(it_begin + left_from), std::make_move_iterator(it_begin + left_to),
+                       std::make_move_iterator(middle + (from - left_from)),
+                       std::make_move_iterator(middle + (to - left_to)), buffer + from, comp);
+        });
+        parallel_for(threads, [&](size_t piece) {
+            long from = size * piece / threads, to = size * (piece + 1) / threads;
+            std::move(buffer + from, buffer + to, it_begin + from);
+        });
+    }
+}
+
+// Parallel merge sort on up to threads threads. With use_buffer an O(n) scratch buffer
+// makes merges linear, otherwise the sort needs O(1) extra memory like merge_sort.
+template<class T, class Comp>
+void parallel_merge_sort(T it_begin, T it_end, Comp comp, size_t threads = std::thread::hardware_concurrency(),
+                         bool use_buffer = true) {
+    threads = std::max<size_t>(1, threads);
+    if (use_buffer) {
+        std::vector<typename std::iterator_traits<T>::value_type> buffer(it_end - it_begin);
+        parallel_sort_buffered(it_begin, it_end, buffer.begin(), comp, threads);
+    } else {
+        parallel_sort_inplace(it_begin, it_end, comp, threads);
+    }
+}
+
+template<class T>
+void parallel_merge_sort(T it_begin, T it_end) {
+    parallel_merge_sort(it_begin, it_end, std::less<typename std::iterator_traits<T>::value_type>());
+}
+
+
+enum class run_formation {
+    // runs of one block_size chunk each, sorted in parallel
+    chunks,
+    // runs twice the memory size on average, longer on nearly sorted input
+    replacement_selection
+};
+
+// Scratch directories of external sorts. Every sort gets file names of its own,
+// runs are striped over the directories round robin, so each one can be on its own disk.
+class sort_context {
+    std::vector<string> directories;
+
+    bool compressed, mapped;
+
+public:
+    // runs are encoded by run_codec if compressed is set and the element type has a codec, which trades
+    // CPU time for disk traffic and pays off on slow disks only; run formation maps the input if mapped
+    // is set, see element_reader
+    explicit sort_context(const std::vector<string> &directories = {"."}, bool compressed = false,
+                          bool mapped = true);
+
+    // one name per directory, unique among the sorts of all processes
+    std::vector<string> scratch_names() const;
+
+    // one name per directory, the same for every process that asks for tag
+    std::vector<string> scratch_names(const string &tag) const;
+
+    bool compress_runs() const;
+
+    bool map_input() const;
+};
+
+inline sort_context::sort_context(const std::vector<string> &directories, bool compressed, bool mapped)
+        : directories(directories), compressed(compressed), mapped(mapped) {
+    if (directories.empty()) {
+        throw std::runtime_error("Can't sort without scratch directories");
+    }
+}
+
+inline std::vector<string> sort_context::scratch_names() const {
+    static std::atomic<unsigned long> counter(0);
+    return scratch_names(std::to_string(getpid()) + "-" + std::to_string(counter++));
+}
+
+inline std::vector<string> sort_context::scratch_names(const string &tag) const {
+    std::vector<string> names;
+    for (auto &directory : directories) {
+        names.push_back(directory + separator() + "externalsortruns#" + tag);
+    }
+    return names;
+}
+
+inline bool sort_context::compress_runs() const {
+    return compressed;
+}
+
+inline bool sort_context::map_input() const {
+    return mapped;
+}
+
+namespace msort_detail {
+    const unsigned long min_block_size = 64 * 1024;
+
+    // Memory of a merge of fan_in runs: every input run holds two blocks, the output holds up to three
+    // (filled, queued, being written) and a header page; see copies_blocks for one more block
+    // per reader and writer.
+    template<class T>
+    unsigned long merge_memory(size_t fan_in, unsigned long block_size) {
+        const bool copied = copies_blocks<T>();
+        return fan_in * block_size * (copied ? 3 : 2) + block_size * (copied ? 4 : 3) + block_header::page_size;
+    }
+
+    // the most runs merged at once in memory_size, zero if not even one fits
+    template<class T>
+    size_t merge_fan_in(unsigned long memory_size, unsigned long block_size) {
+        if (merge_memory<T>(0, block_size) > memory_size) {
+            return 0;
+        }
+        return (memory_size - merge_memory<T>(0, block_size)) / (merge_memory<T>(1, block_size) -
+                                                                  merge_memory<T>(0, block_size));
+    }
+
+    // run and block lists of two passes when runs and blocks are no smaller than block_size
+    inline unsigned long run_metadata(unsigned long size, unsigned long block_size) {
+        return 2 * (size / block_size + 2) * (sizeof(extent) + sizeof(run));
+    }
+
+    // passes over the data when runs of run_size are merged fan_in at a time, the last one included
+    inline size_t merge_passes_count(unsigned long size, unsigned long run_size, size_t fan_in) {
+        size_t runs = (size + run_size - 1) / run_size, passes = 1;
+        for (; runs > fan_in; ++passes) {
+            runs = (runs + fan_in - 1) / fan_in;
+        }
+        return passes;
+    }
+
+    // Chunks for split_and_sort in memory_size: as many sorter threads as there are cores and
+    // two more chunks in flight to keep reading and writing busy, fewer if runs would get smaller than a block.
+    template<class T>
+    bool plan_chunks(sort_plan &plan, unsigned long memory_size, size_t sorter_blocks) {
+        const bool trivial = std::is_trivially_copyable<T>::value;
+        const unsigned long fixed = (copies_blocks<T>() ? plan.block_size : 0) + block_header::page_size;
+        if (memory_size <= fixed) {
+            return false;
+        }
+        for (size_t sorters = std::max(1u, std::thread::hardware_concurrency()); sorters > 0; --sorters) {
+            for (size_t in_flight : {sorters + 2, sorters}) {
+                const size_t chunks = in_flight + sorters * sorter_blocks + (trivial ? 0 : 1);
+                unsigned long run_size = (memory_size - fixed) / chunks;
+                run_size -= run_size % plan.block_size;
+                if (run_size >= plan.block_size) {
+                    plan.sorters = sorters;
+                    plan.in_flight = in_flight;
+                    plan.run_size = run_size;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Block size up to max_block_size, run size and fan-in for a sort of size bytes within memory_size,
+    // with the fewest passes; bigger blocks win among plans with equally many passes.
+    template<class T>
+    sort_plan plan_sort(unsigned long size, unsigned long memory_size, unsigned long max_block_size,
+                        size_t sorter_blocks, run_formation formation) {
+        const unsigned long smallest = std::max<unsigned long>(min_block_size - min_block_size % sizeof(T), sizeof(T));
+        sort_plan best{0, 0, 0, 0, 0, 0};
+        for (unsigned long block_size = std::max(max_block_size, smallest);; block_size /= 2) {
+            sort_plan plan{std::max(smallest, block_size - block_size % sizeof(T)), 0, 0, 0, 0, 0};
+            const unsigned long metadata = run_metadata(size, plan.block_size);
+            if (memory_size > metadata) {
+                plan.fan_in = merge_fan_in<T>(memory_size - metadata, plan.block_size);
+                bool formed;
+                if (formation == run_formation::chunks) {
+                    formed = plan_chunks<T>(plan, memory_size - metadata, sorter_blocks);
+                } else {
+                    // the heap gets what is left besides the blocks, runs are twice the heap on average
+                    const unsigned long blocks = replacement_selection_blocks<T>() * plan.block_size +
+                                                 block_header::page_size + metadata;
+                    const unsigned long heap = memory_size > blocks ? memory_size - blocks : 0;
+                    plan.run_size = 2 * (heap / sizeof(std::pair<size_t, T>)) * sizeof(T);
+                    formed = plan.run_size != 0;
+                }
+                if (formed && plan.fan_in > 1) {
+                    plan.passes = merge_passes_count(size, plan.run_size, plan.fan_in);
+                    if (best.block_size == 0 || plan.passes < best.passes) {
+                        best = plan;
+                    }
+                }
+            }
+            if (plan.block_size == smallest) {
+                break;
+            }
+        }
+        if (best.block_size == 0) {
+            throw std::runtime_error("Can't sort in memory budget of " + std::to_string(memory_size) + " bytes");
+        }
+        return best;
+    }
+
+    // K-way merge of runs of a scratch file, elements with equal keys folded by absorb.
+    template<class T, class Comp, class Absorb>
+    class run_merge {
+        memory_budget::lease memory;
+        // outlives the readers, which wait for their reads
+        block_prefetcher<T> prefetcher;
+        std::vector<std::unique_ptr<run_reader<T>>> readers;
+        loser_tree<T, Comp> tree;
+        Absorb absorb;
+
+        static std::vector<const T *> heads(const std::vector<std::unique_ptr<run_reader<T>>> &readers) {
+            std::vector<const T *> answer;
+            for (auto &reader : readers) {
+                answer.push_back(reader->head());
+            }
+            return answer;
+        }
+
+        std::vector<std::unique_ptr<run_reader<T>>> open_readers(const run *first, const run *last,
+                                                                 scratch_file &scratch) {
+            std::vector<std::unique_ptr<run_reader<T>>> answer;
+            for (; first != last; ++first) {
+                answer.emplace_back(new run_reader<T>(*first, scratch, prefetcher));
+            }
+            return answer;
+        }
+
+    public:
+        // the runs must outlive the merge, blocks of block_size bytes are leased from budget
+        run_merge(const run *first, const run *last, scratch_file &scratch, Comp comp, Absorb absorb,
+                  memory_budget &budget, unsigned long block_size)
+                : memory(budget.acquire(merge_memory<T>(last - first, block_size) - merge_memory<T>(0, block_size))),
+                  readers(open_readers(first, last, scratch)), tree(heads(readers), comp), absorb(absorb) {
+        }
+
+        run_merge(const run_merge &) = delete;
+
+        // false when all runs are exhausted
+        bool next(T &object) {
+            if (tree.top() == nullptr) {
+                return false;
+            }
+            object = *tree.top();
+            tree.replace_top(readers[tree.winner()]->advance());
+            while (tree.top() != nullptr && absorb(object, *tree.top())) {
+                tree.replace_top(readers[tree.winner()]->advance());
+            }
+            return true;
+        }
+    };
+
+    // passes the output of a merge to save(buffer) by blocks of block_size elements;
+    // save may swap the buffer for another one, which is cleared and filled next
+    template<class T, class Merge, class Save>
+    void drain(Merge &merge, size_t block_size, Save save) {
+        std::vector<T> buffer;
+        buffer.reserve(block_size);
+        T object;
+        while (merge.next(object)) {
+            buffer.push_back(std::move(object));
+            if (buffer.size() == block_size) {
+                save(buffer);
+                buffer.clear();
+                buffer.reserve(block_size);
+            }
+        }
+        if (buffer.size() != 0) {
+            save(buffer);
+        }
+    }
+
+    struct no_checkpoint {
+        void operator()() const {
+        }
+    };
+
+    // Merges groups of fan_in runs from input into output, swapping the files after each pass,
+    // until no more than fan_in runs are left in input; checkpoint() is called after every pass.
+    template<class T, class Comp, class Absorb, class Checkpoint = no_checkpoint>
+    void merge_passes(std::vector<run> &runs, scratch_file *&input, scratch_file *&output, const sort_plan &plan,
+                      Comp comp, Absorb absorb, memory_budget &budget, Checkpoint checkpoint = Checkpoint()) {
+        while (runs.size() > plan.fan_in) {
+            output->clear();
+            std::vector<run> merged;
+            memory_budget::lease writing = budget.acquire(merge_memory<T>(0, plan.block_size));
+            block_writer<T, extent> writer([output](const extent &block, const std::vector<T> &data) {
+                output->write(block, data.data());
+            });
+            for (size_t first = 0; first < runs.size(); first += plan.fan_in) {
+                size_t last = std::min(runs.size(), first + plan.fan_in);
+                run_merge<T, Comp, Absorb> merge(runs.data() + first, runs.data() + last, *input, comp, absorb,
+                                                 budget, plan.block_size);
+                merged.emplace_back();
+                drain<T>(merge, plan.block_size / sizeof(T), [&](std::vector<T> &data) {
+                    merged.back().push_back(output->allocate(merged.size() - 1, data.size(), sizeof(T)));
+                    writer.write(merged.back().back(), data);
+                });
+            }
+            writer.finish();
+            runs = std::move(merged);
+            std::swap(input, output);
+            checkpoint();
+        }
+    }
+
+    // The last merge streams straight into the sorted file, which is synced to the disk if durable is set.
+    template<class T, class Comp, class Absorb>
+    void merge_into_file(const std::vector<run> &runs, scratch_file &input, const sort_plan &plan, Comp comp,
+                         Absorb absorb, memory_budget &budget, const string &file_name, bool durable) {
+        int destination = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (destination < 0) {
+            throw std::runtime_error("Can't open file " + file_name);
+        }
+        try {
+            size_t offset = 0;
+            memory_budget::lease writing = budget.acquire(merge_memory<T>(0, plan.block_size));
+            block_writer<T> writer([destination](size_t offset, const std::vector<T> &data) {
+                write_elements_at(destination, offset, data);
+            });
+            run_merge<T, Comp, Absorb> merge(runs.data(), runs.data() + runs.size(), input, comp, absorb, budget,
+                                             plan.block_size);
+            drain<T>(merge, plan.block_size / sizeof(T), [&](std::vector<T> &data) {
+                size_t count = data.size();
+                writer.write(offset, data);
+                offset += count * sizeof(T);
+            });
+            writer.finish();
+            if (durable && fsync(destination) != 0) {
+                throw std::runtime_error("Can't sync file " + file_name);
+            }
+        } catch (...) {
+            close(destination);
+            throw;
+        }
+        close(destination);
+    }
+
+    // Sorts within memory_size bytes. sorter(chunk) forms a run from a chunk using sorter_blocks
+    // more chunks of memory, see split_and_sort; absorb combines equal elements of the output, see no_combine.
+    template<class T, class Comp, class Sorter, class Absorb>
+    void sort_file(const std::string &file_name, unsigned long memory_size, unsigned long block_size, Comp comp,
+                   Sorter sorter, size_t sorter_blocks, Absorb absorb, run_formation formation,
+                   const sort_context &context) {
+        const sort_plan plan = plan_sort<T>(get_raw_file_length(file_name), memory_size, block_size, sorter_blocks,
+                                            formation);
+        memory_budget budget(memory_size);
+        memory_budget::lease metadata = budget.acquire(run_metadata(get_raw_file_length(file_name), plan.block_size));
+        scratch_file first(context.scratch_names(), context.compress_runs()),
+                second(context.scratch_names(), context.compress_runs());
+        scratch_file *input = &first, *output = &second;
+        std::vector<run> runs = formation == run_formation::chunks ?
+                                split_and_sort<T>(file_name, plan, sorter, sorter_blocks, *input, budget,
+                                                  context.map_input()) :
+                                replacement_selection<T>(file_name, plan, comp, absorb, *input, budget,
+                                                         context.map_input());
+
+        merge_passes<T>(runs, input, output, plan, comp, absorb, budget);
+        output->clear();
+        merge_into_file<T>(runs, *input, plan, comp, absorb, budget, file_name, false);
+    }
+}
+
+
+template<class T, class Comp>
+void
+external_sort(const std::string &file_name, unsigned long  memory_size, unsigned long block_size, Comp comp,
+              run_formation formation = run_formation::chunks, const sort_context &context = sort_context()) {
+    msort_detail::sort_file<T>(file_name, memory_size, block_size, comp,
+                               [comp](std::vector<T> &data) { std::sort(data.begin(), data.end(), comp); }, 0,
+                               msort_detail::no_combine(), formation, context);
+}
+
+// Sorts by key(element), which is integral, floating point or std::array<unsigned char, N>;
+// runs are formed with radix sort.
+template<class T, class Key>
+void external_sort_by_key(const std::string &file_name, unsigned long memory_size, unsigned long block_size, Key key,
+                          run_formation formation = run_formation::chunks,
+                          const sort_context &context = sort_context()) {
+    using traits = radix_traits<radix_key<T, Key>>;
+    msort_detail::sort_file<T>(file_name, memory_size, block_size,
+                               [key](const T &f, const T &s) -> bool { return traits::less(key(f), key(s)); },
+                               [key](std::vector<T> &data) { radix_sort(data, key); }, 1, msort_detail::no_combine(),
+                               formation, context);
+}
+
+// Record sort for wide elements with short keys, which are integral, floating point or
+// std::array<unsigned char, N>: runs are formed by prefix_sort, which moves every element once.
+// Merges compare whole keys, as a prefix would be recomputed on every comparison there.
+template<class T, class Key>
+void external_sort_records(const std::string &file_name, unsigned long memory_size, unsigned long block_size, Key key,
+                           run_formation formation = run_formation::chunks,
+                           const sort_context &context = sort_context()) {
+    using traits = radix_traits<radix_key<T, Key>>;
+    msort_detail::sort_file<T>(file_name, memory_size, block_size, [key](const T &f, const T &s) -> bool {
+        return traits::less(key(f), key(s));
+    }, [key](std::vector<T> &data) { prefix_sort(data, key); },
+                               // a sorted copy and a 16 byte entry per element
+                               1 + (16 + sizeof(T) - 1) / sizeof(T), msort_detail::no_combine(), formation, context);
+}
+
+// Sorts by key(element) and replaces every group of elements with equal keys by one element,
+// folded with combine(accumulated, element). The combiner runs on every sorted run and
+// again in each merge, so duplicates are not carried through the passes; it should be
+// associative and commutative as the order of equal elements is not kept.
+template<class T, class Key, class Combine>
+void external_sort_combine(const std::string &file_name, unsigned long memory_size, unsigned long block_size,
+                           Key key, Combine combine, run_formation formation = run_formation::chunks,
+                           const sort_context &context = sort_context()) {
+    auto comp = [key](const T &f, const T &s) -> bool { return key(f) < key(s); };
+    auto absorb = [comp, combine](T &accumulated, const T &next) -> bool {
+        if (comp(accumulated, next)) {
+            return false;
+        }
+        accumulated = combine(accumulated, next);
+        return true;
+    };
+    msort_detail::sort_file<T>(file_name, memory_size, block_size, comp, [comp, absorb](std::vector<T> &data) {
+        std::sort(data.begin(), data.end(), comp);
+        msort_detail::combine_sorted(data, absorb);
+    }, 0, absorb, formation, context);
+}
+
+namespace {
+    template<class T>
+    void external_sort(const std::string &file_name, unsigned long memory_size, unsigned long block_size,
+                       run_formation formation, const sort_context &context, std::true_type) {
+        external_sort_by_key<T>(file_name, memory_size, block_size, identity_key(), formation, context);
+    }
+
+    template<class T>
+    void external_sort(const std::string &file_name, unsigned long memory_size, unsigned long block_size,
+                       run_formation formation, const sort_context &context, std::false_type) {
+        external_sort<T>(file_name, memory_size, block_size,
+                         [](const T& f, const T& s) -> bool { return f < s; }, formation, context);
+    }
+}
+
+// numbers are sorted by radix sort
+template<class T>
+void external_sort(const std::string &file_name, unsigned long  memory_size, unsigned long block_size,
+                   run_formation formation = run_formation::chunks, const sort_context &context = sort_context()) {
+    external_sort<T>(file_name, memory_size, block_size, formation, context, std::is_arithmetic<T>());
+}
+
+// Sorted elements of an external sort, merged lazily from the runs as they are read.
+template<class T, class Comp = std::less<T>, class Absorb = msort_detail::no_combine>
+class sorted_stream {
+    std::unique_ptr<msort_detail::memory_budget> budget;
+    msort_detail::memory_budget::lease metadata;
+    std::unique_ptr<msort_detail::scratch_file> first, second;
+    std::vector<msort_detail::run> runs;
+    std::unique_ptr<msort_detail::run_merge<T, Comp, Absorb>> merge;
+
+public:
+    // Takes over the runs stored in first, second is used by the merge passes. The merges
+    // follow plan and lease their memory from budget, metadata is the lease of the run lists.
+    sorted_stream(std::unique_ptr<msort_detail::scratch_file> first, std::unique_ptr<msort_detail::scratch_file> second,
+                  std::vector<msort_detail::run> runs, std::unique_ptr<msort_detail::memory_budget> budget,
+                  msort_detail::memory_budget::lease metadata, const msort_detail::sort_plan &plan,
+                  Comp comp = Comp(), Absorb absorb = Absorb());
+
+    sorted_stream(sorted_stream &&) = default;
+
+    // false when the stream is over
+    bool next(T &object);
+};
+
+template<class T, class Comp, class Absorb>
+sorted_stream<T, Comp, Absorb>::sorted_stream(std::unique_ptr<msort_detail::scratch_file> first,
+                                              std::unique_ptr<msort_detail::scratch_file> second,
+                                              std::vector<msort_detail::run> runs,
+                                              std::unique_ptr<msort_detail::memory_budget> budget,
+                                              msort_detail::memory_budget::lease metadata,
+                                              const msort_detail::sort_plan &plan, Comp comp, Absorb absorb)
+        : budget(std::move(budget)), metadata(std::move(metadata)), first(std::move(first)),
+          second(std::move(second)), runs(std::move(runs)) {
+    msort_detail::scratch_file *input = this->first.get(), *output = this->second.get();
+    msort_detail::merge_passes<T>(this->runs, input, output, plan, comp, absorb, *this->budget);
+    output->clear();
+    merge.reset(new msort_detail::run_merge<T, Comp, Absorb>(this->runs.data(), this->runs.data() + this->runs.size(),
+                                                             *input, comp, absorb, *this->budget, plan.block_size));
+}
+
+template<class T, class Comp, class Absorb>
+bool sorted_stream<T, Comp, Absorb>::next(T &object) {
+    return merge->next(object);
+}
+
+// Sorts the elements of file_name within memory_size bytes without rewriting the file,
+// the final merge runs as the stream is read.
+template<class T, class Comp>
+sorted_stream<T, Comp> external_sort_stream(const std::string &file_name, unsigned long memory_size,
+                                            unsigned long block_size, Comp comp,
+                                            run_formation formation = run_formation::chunks,
+                                            const sort_context &context = sort_context()) {
+    const unsigned long size = get_raw_file_length(file_name);
+    const msort_detail::sort_plan plan = msort_detail::plan_sort<T>(size, memory_size, block_size, 0, formation);
+    std::unique_ptr<msort_detail::memory_budget> budget(new msort_detail::memory_budget(memory_size));
+    msort_detail::memory_budget::lease metadata = budget->acquire(msort_detail::run_metadata(size, plan.block_size));
+    std::unique_ptr<msort_detail::scratch_file>
+            first(new msort_detail::scratch_file(context.scratch_names(), context.compress_runs())),
+            second(new msort_detail::scratch_file(context.scratch_names(), context.compress_runs()));
+    std::vector<msort_detail::run> runs = formation == run_formation::chunks ?
+                            msort_detail::split_and_sort<T>(file_name, plan, [comp](std::vector<T> &data) {
+                                std::sort(data.begin(), data.end(), comp);
+                            }, 0, *first, *budget, context.map_input()) :
+                            msort_detail::replacement_selection<T>(file_name, plan, comp, msort_detail::no_combine(),
+                                                                   *first, *budget, context.map_input());
+    return sorted_stream<T, Comp>(std::move(first), std::move(second), std::move(runs), std::move(budget),
+                                  std::move(metadata), plan, comp);
+}
+
+// Push-based external sort within memory_size bytes: elements are collected with add(),
+// the buffer is sorted and saved as a run whenever it is full, finish() hands the runs over to a sorted_stream.
+template<class T, class Comp = std::less<T>>
+class external_sorter {
+    Comp comp;
+    msort_detail::sort_plan plan;
+    std::unique_ptr<msort_detail::memory_budget> budget;
+    msort_detail::memory_budget::lease buffering, metadata;
+    std::unique_ptr<msort_detail::scratch_file> first, second;
+    std::vector<msort_detail::run> runs;
+    std::vector<T> buffer;
+    size_t capacity;
+
+    void flush();
+
+public:
+    external_sorter(unsigned long memory_size, unsigned long block_size, Comp comp = Comp(),
+                    const sort_context &context = sort_context());
+
+    external_sorter(const external_sorter &) = delete;
+
+    void add(const T &object);
+
+    // the sorter can't be used after it
+    sorted_stream<T, Comp> finish();
+};
+
+template<class T, class Comp>
+external_sorter<T, Comp>::external_sorter(unsigned long memory_size, unsigned long block_size, Comp comp,
+                                          const sort_context &context)
+        : comp(comp), plan(msort_detail::plan_sort<T>(0, memory_size, block_size, 0, run_formation::chunks)),
+          budget(new msort_detail::memory_budget(memory_size)), metadata(budget->acquire(0)),
+          first(new msort_detail::scratch_file(context.scratch_names(), context.compress_runs())),
+          second(new msort_detail::scratch_file(context.scratch_names(), context.compress_runs())) {
+    // the run lists get a 64th of memory, saving a run may need a block for serialization and a header page
+    const unsigned long reserved = memory_size / 64 + block_header::page_size +
+                                   (msort_detail::copies_blocks<T>() ? plan.block_size : 0);
+    capacity = memory_size > reserved ? (memory_size - reserved) / sizeof(T) : 0;
+    if (capacity == 0) {
+        throw std::runtime_error("Can't sort in memory budget of " + std::to_string(memory_size) + " bytes");
+    }
+    buffering = budget->acquire(capacity * sizeof(T) + reserved - memory_size / 64);
+    buffer.reserve(capacity);
+}
+
+template<class T, class Comp>
+void external_sorter<T, Comp>::flush() {
+    if (buffer.empty()) {
+        return;
+    }
+    std::sort(buffer.begin(), buffer.end(), comp);
+    const size_t elements = plan.block_size / sizeof(T);
+    // the list of the run now and after merges
+    metadata.grow(2 * ((buffer.size() + elements - 1) / elements * sizeof(msort_detail::extent) +
+                       sizeof(msort_detail::run)));
+    runs.emplace_back();
+    for (size_t position = 0; position < buffer.size(); position += elements) {
+        size_t count = std::min(buffer.size() - position, elements);
+        runs.back().push_back(first->allocate(runs.size() - 1, count, sizeof(T)));
+        first->write(runs.back().back(), buffer.data() + position);
+    }
+    buffer.clear();
+}
+
+template<class T, class Comp>
+void external_sorter<T, Comp>::add(const T &object) {
+    buffer.push_back(object);
+    if (buffer.size() == capacity) {
+        flush();
+    }
+}
+
+template<class T, class Comp>
+sorted_stream<T, Comp> external_sorter<T, Comp>::finish() {
+    flush();
+    buffer = std::vector<T>();
+    buffering = msort_detail::memory_budget::lease();
+    plan.fan_in = msort_detail::merge_fan_in<T>(budget->available(), plan.block_size);
+    if (plan.fan_in < 2) {
+        throw std::runtime_error("Can't merge the runs in what is left of the memory budget");
+    }
+    return sorted_stream<T, Comp>(std::move(first), std::move(second), std::move(runs), std::move(budget),
+                                  std::move(metadata), plan, comp);
+}
+
+namespace msort_detail {
+    // Appends raw elements to a new file through a buffer of block_size bytes,
+    // a temporary file is removed with the appender.
+    template<class T>
+    class element_appender {
+        const string name;
+        const bool temporary;
+        int fd;
+        size_t offset = 0, count = 0;
+        const size_t capacity;
+        std::vector<T> buffer;
+
+    public:
+        element_appender(const string &name, unsigned long block_size, bool temporary)
+                : name(name), temporary(temporary), capacity(std::max<size_t>(1, block_size / sizeof(T))) {
+            fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                throw std::runtime_error("Can't open file " + name);
+            }
+            buffer.reserve(capacity);
+        }
+
+        element_appender(const element_appender &) = delete;
+
+        void push(const T &object) {
+            buffer.push_back(object);
+            ++count;
+            if (buffer.size() == capacity) {
+                flush();
+            }
+        }
+
+        void flush() {
+            write_elements_at(fd, offset, buffer);
+            offset += buffer.size() * sizeof(T);
+            buffer.clear();
+        }
+
+        // flushes and gives the memory of the buffer back
+        void finish() {
+            flush();
+            buffer = std::vector<T>();
+        }
+
+        const string &file_name() const {
+            return name;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        ~element_appender() {
+            close(fd);
+            if (temporary) {
+                std::remove(name.c_str());
+            }
+        }
+    };
+
+    // Up to parts - 1 increasing splitters by comp, evenly spaced among samples random elements
+    // of a file of size raw elements; equal ones are kept once.
+    template<class T, class Comp>
+    std::vector<T> sample_splitters(const string &file_name, size_t size, size_t parts, size_t samples, Comp comp,
+                                    std::mt19937_64 &random) {
+        std::vector<T> sample;
+        sample.reserve(samples);
+        int fd = open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Can't open file " + file_name);
+        }
+        try {
+            for (size_t i = 0; i < samples; ++i) {
+                sample.push_back(read_element_at<T>(fd, random() % size));
+            }
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        std::sort(sample.begin(), sample.end(), comp);
+
+        std::vector<T> splitters;
+        splitters.reserve(parts);
+        for (size_t i = 1; i < parts; ++i) {
+            const T &splitter = sample[i * samples / parts];
+            if (splitters.empty() || comp(splitters.back(), splitter)) {
+                splitters.push_back(splitter);
+            }
+        }
+        return splitters;
+    }
+
+    // Element of rank rank by comp of a file of raw elements. Pivots are picked from random samples,
+    // a pass counts the elements between neighbouring pivots, the next one gathers the part holding the rank.
+    // A part too big for memory is spilled to a file and selected from again.
+    template<class T, class Comp>
+    T select_element(const string &file_name, size_t rank, unsigned long memory_size, unsigned long block_size,
+                     Comp comp, const sort_context &context) {
+        block_size = std::max<unsigned long>(sizeof(T), std::min(block_size, memory_size / 8));
+        block_size -= block_size % sizeof(T);
+        memory_budget budget(memory_size);
+        // a block being read, its deserialization copy and a block being spilled
+        memory_budget::lease reading = budget.acquire(3 * block_size);
+        const size_t capacity = budget.available() / sizeof(T);
+        if (capacity < 64) {
+            throw std::runtime_error("Can't select in memory budget of " + std::to_string(memory_size) + " bytes");
+        }
+
+        std::mt19937_64 random(rank);
+        std::unique_ptr<element_appender<T>> spill;
+        string current = file_name;
+        for (size_t round = 0;; ++round) {
+            const size_t size = get_raw_file_length(current) / sizeof(T);
+            if (rank >= size) {
+                throw std::runtime_error("Can't select rank " + std::to_string(rank) + " of " + std::to_string(size));
+            }
+            if (size <= capacity) {
+                memory_budget::lease memory = budget.acquire(size * sizeof(T));
+                std::vector<T> data;
+                data.reserve(size);
+                scan_elements<T>(current, block_size, [&data](const T &object) { data.push_back(object); });
+                std::nth_element(data.begin(), data.begin() + rank, data.end(), comp);
+                return data[rank];
+            }
+
+            // parts of about a quarter of memory, pivots take at most an eighth of it
+            const size_t parts = std::min(capacity / 8, 4 * size / capacity + 1);
+            memory_budget::lease pivots_memory = budget.acquire(parts * sizeof(T));
+            std::vector<T> pivots;
+            {
+                const size_t samples = std::min(capacity / 4, 32 * parts);
+                memory_budget::lease samples_memory = budget.acquire(samples * sizeof(T));
+                pivots = sample_splitters<T>(current, size, parts, samples, comp, random);
+            }
+
+            // part b holds the elements between pivots b - 1 and b, those equal to pivot b - 1 are counted apart
+            auto part = [&](const T &object) -> size_t {
+                return std::upper_bound(pivots.begin(), pivots.end(), object, comp) - pivots.begin();
+            };
+            std::vector<size_t> equal(pivots.size() + 1), greater(pivots.size() + 1);
+            scan_elements<T>(current, block_size, [&](const T &object) {
+                size_t b = part(object);
+                ++(b > 0 && !comp(pivots[b - 1], object) ? equal[b] : greater[b]);
+            });
+            size_t target = 0;
+            for (;; ++target) {
+                if (rank < equal[target]) {
+                    return pivots[target - 1];
+                }
+                rank -= equal[target];
+                if (rank < greater[target]) {
+                    break;
+                }
+                rank -= greater[target];
+            }
+
+            auto inside = [&](const T &object) {
+                return part(object) == target && (target == 0 || comp(pivots[target - 1], object));
+            };
+            if (greater[target] <= budget.available() / sizeof(T)) {
+                memory_budget::lease memory = budget.acquire(greater[target] * sizeof(T));
+                std::vector<T> data;
+                data.reserve(greater[target]);
+                scan_elements<T>(current, block_size, [&](const T &object) {
+                    if (inside(object)) {
+                        data.push_back(object);
+                    }
+                });
+                std::nth_element(data.begin(), data.begin() + rank, data.end(), comp);
+                return data[rank];
+            }
+            std::unique_ptr<element_appender<T>> next(
+                    new element_appender<T>(context.scratch_names().front(), block_size, true));
+            scan_elements<T>(current, block_size, [&](const T &object) {
+                if (inside(object)) {
+                    next->push(object);
+                }
+            });
+            next->flush();
+            spill = std::move(next);
+            current = spill->file_name();
+        }
+    }
+
+    template<class T, class Comp>
+    void smallest_elements(const string &file_name, const string &output_name, size_t k, unsigned long memory_size,
+                           unsigned long block_size, Comp comp, const sort_context &context) {
+        k = std::min<size_t>(k, get_raw_file_length(file_name) / sizeof(T));
+        block_size = std::max<unsigned long>(sizeof(T), std::min(block_size, memory_size / 8));
+        block_size -= block_size % sizeof(T);
+        // a block being read and its deserialization copy, the answer is written in one go
+        if (k * sizeof(T) * 2 + 2 * block_size <= memory_size) {
+            std::vector<T> heap;
+            heap.reserve(k);
+            scan_elements<T>(file_name, block_size, [&](const T &object) {
+                if (heap.size() < k) {
+                    heap.push_back(object);
+                    std::push_heap(heap.begin(), heap.end(), comp);
+                } else if (k != 0 && comp(object, heap.front())) {
+                    std::pop_heap(heap.begin(), heap.end(), comp);
+                    heap.back() = object;
+                    std::push_heap(heap.begin(), heap.end(), comp);
+                }
+            });
+            std::sort_heap(heap.begin(), heap.end(), comp);
+            element_appender<T> output(output_name, block_size, false);
+            for (auto &object : heap) {
+                output.push(object);
+            }
+            output.flush();
+            return;
+        }
+
+        const T pivot = select_element<T>(file_name, k - 1, memory_size, block_size, comp, context);
+        {
+            // elements equal to the pivot are kept aside, as many are taken as needed to make k
+            element_appender<T> output(output_name, block_size, false);
+            element_appender<T> equal(context.scratch_names().front(), block_size, true);
+            scan_elements<T>(file_name, block_size, [&](const T &object) {
+                if (comp(object, pivot)) {
+                    output.push(object);
+                } else if (!comp(pivot, object) && equal.size() < k) {
+                    equal.push(object);
+                }
+            });
+            equal.flush();
+            size_t missing = k - output.size();
+            scan_elements<T>(equal.file_name(), block_size, [&](const T &object) {
+                if (missing != 0) {
+                    output.push(object);
+                    --missing;
+                }
+            });
+            output.flush();
+        }
+        external_sort<T>(output_name, memory_size, block_size, comp, run_formation::chunks, context);
+    }
+}
+
+// Element of rank n (from zero) by comp of a file much larger than memory, the file is left as it is.
+// A couple of read passes over the file are taken per round, a round needs no writes unless
+// the elements around the rank don't fit in memory_size.
+template<class T, class Comp>
+T external_nth_element(const std::string &file_name, size_t n, unsigned long memory_size, unsigned long block_size,
+                       Comp comp, const sort_context &context = sort_context()) {
+    return msort_detail::select_element<T>(file_name, n, memory_size, block_size, comp, context);
+}
+
+// Writes the k smallest elements by comp of file_name, sorted, to output_name. If they fit in memory_size
+// it takes one pass with a bounded heap, otherwise the k-th element is selected, smaller elements
+// are written out and sorted.
+template<class T, class Comp>
+void external_top_k(const std::string &file_name, const std::string &output_name, size_t k,
+                    unsigned long memory_size, unsigned long block_size, Comp comp,
+                    const sort_context &context = sort_context()) {
+    msort_detail::smallest_elements<T>(file_name, output_name, k, memory_size, block_size, comp, context);
+}
+
+namespace msort_detail {
+    // a bucket that sampling can't split, kept until the partitioning is over
+    template<class T>
+    struct unsplit_bucket {
+        std::unique_ptr<element_appender<T>> file;
+        size_t position;
+    };
+
+    // Sorts the file of raw elements input_name by comp into destination from element position on
+    // within memory_size bytes of budget, held by the lease. Splitters sampled from the input cut it
+    // into buckets, which one pass distributes into scratch files striped over the directories of context;
+    // then the lease is returned and threads workers sort the buckets, largest first, each with a share
+    // of memory_size leased anew. A bucket too big for its share is partitioned again.
+    // A bucket that holds all of its input goes to unsplit, see sample_sort_file.
+    template<class T, class Comp>
+    void partition_sort(const string &input_name, int destination, size_t position, unsigned long memory_size,
+                        unsigned long block_size, Comp comp, size_t threads, const sort_context &context,
+                        memory_budget &budget, memory_budget::lease held, std::vector<unsplit_bucket<T>> &unsplit,
+                        std::mutex &unsplit_lock) {
+        const size_t size = get_raw_file_length(input_name) / sizeof(T);
+        threads = std::max<size_t>(1, threads);
+        block_size = std::max<unsigned long>(sizeof(T), std::min(block_size, memory_size / 8));
+        block_size -= block_size % sizeof(T);
+        // the elements, the buffer of parallel_merge_sort if there are several threads and a block being read
+        if ((threads > 1 ? 2 : 1) * size * sizeof(T) + 2 * block_size <= memory_size) {
+            std::vector<T> data;
+            data.reserve(size);
+            scan_elements<T>(input_name, block_size, [&data](const T &object) { data.push_back(object); });
+            if (threads > 1) {
+                parallel_merge_sort(data.begin(), data.end(), comp, threads);
+            } else {
+                std::sort(data.begin(), data.end(), comp);
+            }
+            write_elements_at(destination, position * sizeof(T), data);
+            return;
+        }
+
+        // buckets of about a quarter of a share leave room for uneven samples, every bucket buffers
+        // a block of at least a page while distributing, all of them take half of memory_size
+        const unsigned long share = memory_size / threads;
+        size_t parts = std::max<size_t>(2 * threads, 4 * size * sizeof(T) / share + 1);
+        unsigned long bucket_block = std::min<unsigned long>(block_size, memory_size / (2 * parts));
+        if (bucket_block < block_header::page_size) {
+            bucket_block = block_header::page_size;
+            parts = memory_size / (2 * bucket_block);
+        }
+        bucket_block = std::max<unsigned long>(sizeof(T), bucket_block - bucket_block % sizeof(T));
+        if (parts < 2) {
+            throw std::runtime_error("Can't partition in memory budget of " + std::to_string(memory_size) + " bytes");
+        }
+
+        std::mt19937_64 random(size);
+        const std::vector<T> splitters = sample_splitters<T>(input_name, size, parts,
+                                                             std::min(32 * parts, memory_size / 4 / sizeof(T)),
+                                                             comp, random);
+        std::vector<std::unique_ptr<element_appender<T>>> buckets;
+        for (size_t b = 0; b <= splitters.size(); ++b) {
+            const std::vector<string> names = context.scratch_names();
+            buckets.emplace_back(new element_appender<T>(names[b % names.size()], bucket_block, true));
+        }
+        scan_elements<T>(input_name, block_size, [&](const T &object) {
+            buckets[std::upper_bound(splitters.begin(), splitters.end(), object, comp) - splitters.begin()]->push(
+                    object);
+        });
+
+        std::vector<size_t> offsets, order;
+        for (size_t b = 0, offset = position; b < buckets.size(); offset += buckets[b++]->size()) {
+            buckets[b]->finish();
+            offsets.push_back(offset);
+            order.push_back(b);
+        }
+        std::sort(order.begin(), order.end(), [&buckets](size_t f, size_t s) {
+            return buckets[f]->size() > buckets[s]->size();
+        });
+
+        held = memory_budget::lease();
+
+        std::atomic<size_t> next(0);
+        parallel_for(std::min(threads, buckets.size()), [&](size_t) {
+            for (size_t i; (i = next++) < order.size();) {
+                const size_t b = order[i];
+                const string name = buckets[b]->file_name();
+                if (buckets[b]->size() < size) {
+                    partition_sort<T>(name, destination, offsets[b], share, block_size, comp, 1, context, budget,
+                                      budget.acquire(share), unsplit, unsplit_lock);
+                    buckets[b].reset();
+                } else {
+                    // all the elements are equal to a splitter or between two, sampling gains nothing here
+                    std::lock_guard<std::mutex> guard(unsplit_lock);
+                    unsplit.push_back(unsplit_bucket<T>{std::move(buckets[b]), offsets[b]});
+                }
+            }
+        });
+    }
+
+    // Sample sort of input_name into destination. Buckets that sampling can't split are sorted
+    // one by one by external_sort with the whole memory_size once the partitioning is over,
+    // as a worker's share may be too small for it.
+    template<class T, class Comp>
+    void sample_sort_file(const string &input_name, int destination, unsigned long memory_size,
+                          unsigned long block_size, Comp comp, size_t threads, const sort_context &context) {
+        std::vector<unsplit_bucket<T>> unsplit;
+        std::mutex unsplit_lock;
+        memory_budget budget(memory_size);
+        partition_sort<T>(input_name, destination, 0, memory_size, block_size, comp, threads, context, budget,
+                          budget.acquire(memory_size), unsplit, unsplit_lock);
+        block_size = std::max<unsigned long>(sizeof(T), std::min(block_size, memory_size / 8));
+        for (auto &bucket : unsplit) {
+            const string name = bucket.file->file_name();
+            external_sort<T>(name, memory_size, block_size, comp, run_formation::chunks, context);
+            std::vector<T> block;
+            size_t offset = bucket.position;
+            auto save = [&]() {
+                write_elements_at(destination, offset * sizeof(T), block);
+                offset += block.size();
+                block.clear();
+            };
+            scan_elements<T>(name, block_size, [&](const T &object) {
+                block.push_back(object);
+                if (block.size() * sizeof(T) >= block_size) {
+                    save();
+                }
+            });
+            save();
+            bucket.file.reset();
+        }
+    }
+}
+
+// Sample sort on up to threads threads: sampled splitters cut the file into buckets written to scratch
+// files in one pass, then the buckets are sorted independently and written at their final offsets,
+// so there is no global merge. Meant for many cores and scratch directories on several disks.
+template<class T, class Comp>
+void external_sample_sort(const std::string &file_name, unsigned long memory_size, unsigned long block_size, Comp comp,
+                          size_t threads = std::thread::hardware_concurrency(),
+                          const sort_context &context = sort_context()) {
+    int destination = open(file_name.c_str(), O_WRONLY);
+    if (destination < 0) {
+        throw std::runtime_error("Can't open file " + file_name);
+    }
+    try {
+        msort_detail::sample_sort_file<T>(file_name, destination, memory_size, block_size, comp, threads, context);
+    } catch (...) {
+        close(destination);
+        throw;
+    }
+    close(destination);
+}
+
+namespace msort_detail {
+    // a rewrite or a replacement of a file changes its identity
+    struct file_identity {
+        uint64_t size = 0, inode = 0, modified = 0;
+
+        bool operator==(const file_identity &another) const {
+            return size == another.size && inode == another.inode && modified == another.modified;
+        }
+    };
+
+    // false if there is no such file
+    inline bool identify_file(const string &file_name, file_identity &identity) {
+        struct stat status;
+        if (stat(file_name.c_str(), &status) != 0) {
+            return false;
+        }
+        identity.size = status.st_size;
+        identity.inode = status.st_ino;
+        identity.modified = uint64_t(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+        return true;
+    }
+
+    // Checkpoint of a resumable sort of file, kept next to it: the runs of names[current] after
+    // run formation or a merge pass. Once complete, file identifies the sorted output waiting to be renamed.
+    struct sort_manifest {
+        static constexpr unsigned current_version = 1;
+
+        file_identity file;
+        bool complete = false;
+        size_t element_size = 0;
+        bool compress = false;
+        sort_plan plan{0, 0, 0, 0, 0, 0};
+        std::vector<string> names[2];
+        size_t current = 0;
+    };
+
+    // The manifest is written aside, synced and renamed over the previous one,
+    // so a failure leaves one of them whole.
+    inline void save_manifest(const string &manifest_name, const sort_manifest &manifest,
+                              const std::vector<run> &runs) {
+        std::ostringstream out;
+        out << "sortmanifest " << sort_manifest::current_version << "\n"
+            << manifest.file.size << " " << manifest.file.inode << " " << manifest.file.modified << "\n"
+            << manifest.complete << " " << manifest.element_size << " " << manifest.compress << "\n"
+            << manifest.plan.block_size << " " << manifest.plan.run_size << " " << manifest.plan.sorters << " "
+            << manifest.plan.in_flight << " " << manifest.plan.fan_in << " " << manifest.plan.passes << "\n";
+        for (auto &names : manifest.names) {
+            out << names.size() << "\n";
+            for (auto &name : names) {
+                out << name << "\n";
+            }
+        }
+        out << manifest.current << " " << runs.size() << "\n";
+        for (auto &blocks : runs) {
+            out << blocks.size();
+            for (auto &block : blocks) {
+                out << " " << block.disk << " " << block.offset << " " << block.count;
+            }
+            out << "\n";
+        }
+
+        const string text = out.str(), temporary = manifest_name + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Can't open file " + temporary);
+        }
+        try {
+            write_fully(fd, text.data(), text.size(), 0);
+            if (fsync(fd) != 0) {
+                throw std::runtime_error("Can't sync file " + temporary);
+            }
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        if (std::rename(temporary.c_str(), manifest_name.c_str()) != 0) {
+            throw std::runtime_error("Can't rename file " + temporary);
+        }
+    }
+
+    // false if there is no manifest or it is damaged
+    inline bool load_manifest(const string &manifest_name, sort_manifest &manifest, std::vector<run> &runs) {
+        std::ifstream in(manifest_name);
+        string signature;
+        unsigned version = 0;
+        if (!(in >> signature >> version) || signature != "sortmanifest" ||
+            version != sort_manifest::current_version) {
+            return false;
+        }
+        in >> manifest.file.size >> manifest.file.inode >> manifest.file.modified
+           >> manifest.complete >> manifest.element_size >> manifest.compress
+           >> manifest.plan.block_size >> manifest.plan.run_size >> manifest.plan.sorters
+           >> manifest.plan.in_flight >> manifest.plan.fan_in >> manifest.plan.passes;
+        for (auto &names : manifest.names) {
+            size_t count = 0;
+            in >> count;
+            in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            names.clear();
+            string name;
+            for (size_t i = 0; i < count && std::getline(in, name); ++i) {
+                names.push_back(name);
+            }
+        }
+        size_t count = 0;
+        in >> manifest.current >> count;
+        runs.clear();
+        for (size_t i = 0; i < count && in; ++i) {
+            size_t blocks = 0;
+            in >> blocks;
+            runs.emplace_back();
+            for (size_t j = 0; j < blocks && in; ++j) {
+                extent block;
+                in >> block.disk >> block.offset >> block.count;
+                runs.back().push_back(block);
+            }
+        }
+        return !in.fail() && manifest.current < 2 && !manifest.names[0].empty() &&
+               manifest.names[0].size() == manifest.names[1].size();
+    }
+
+    inline void rename_file(const string &from, const string &to) {
+        if (std::rename(from.c_str(), to.c_str()) != 0) {
+            throw std::runtime_error("Can't rename file " + from + " to " + to);
+        }
+    }
+
+    template<class T, class Comp>
+    void resumable_sort(const string &file_name, unsigned long memory_size, unsigned long block_size, Comp comp,
+                        const sort_context &context) {
+        const string manifest_name = file_name + ".sortmanifest", output_name = file_name + ".sorted";
+        sort_manifest manifest;
+        std::vector<run> runs;
+        file_identity identity;
+        bool resumed = load_manifest(manifest_name, manifest, runs);
+        if (resumed) {
+            file_identity output;
+            if (manifest.complete && identify_file(output_name, output) && output == manifest.file) {
+                // sorted, but not renamed yet
+                rename_file(output_name, file_name);
+            }
+            bool stale = !identify_file(file_name, identity) || !(identity == manifest.file) ||
+                         manifest.element_size != sizeof(T);
+            for (auto &name : manifest.names[manifest.current]) {
+                stale = stale || (!manifest.complete && !identify_file(name, output));
+            }
+            if (stale || manifest.complete) {
+                for (auto &names : manifest.names) {
+                    for (auto &name : names) {
+                        std::remove(name.c_str());
+                    }
+                }
+                std::remove(manifest_name.c_str());
+                if (!stale) {
+                    return;
+                }
+                manifest = sort_manifest();
+                runs.clear();
+                resumed = false;
+            }
+        }
+        if (!resumed) {
+            if (!identify_file(file_name, identity)) {
+                throw std::runtime_error("Can't open file " + file_name);
+            }
+            manifest.file = identity;
+            manifest.element_size = sizeof(T);
+            manifest.compress = context.compress_runs();
+            manifest.plan = plan_sort<T>(identity.size, memory_size, block_size, 0, run_formation::chunks);
+            // the same names for every attempt, so files of an attempt that failed before its first
+            // checkpoint are overwritten
+            const string tag = std::to_string(std::hash<string>()(file_name));
+            manifest.names[0] = context.scratch_names(tag + "-0");
+            manifest.names[1] = context.scratch_names(tag + "-1");
+        }
+
+        const sort_plan plan = manifest.plan;
+        memory_budget budget(memory_size);
+        memory_budget::lease metadata = budget.acquire(run_metadata(manifest.file.size, plan.block_size));
+        {
+            scratch_file first(manifest.names[0], manifest.compress, resumed),
+                    second(manifest.names[1], manifest.compress, resumed);
+            first.persist(true);
+            second.persist(true);
+            scratch_file *input = manifest.current == 0 ? &first : &second;
+            scratch_file *output = manifest.current == 0 ? &second : &first;
+            auto checkpoint = [&]() {
+                input->sync();
+                manifest.current = input == &first ? 0 : 1;
+                save_manifest(manifest_name, manifest, runs);
+            };
+            if (!resumed) {
+                runs = split_and_sort<T>(file_name, plan, [comp](std::vector<T> &data) {
+                    std::sort(data.begin(), data.end(), comp);
+                }, 0, *input, budget, context.map_input());
+                checkpoint();
+            }
+            merge_passes<T>(runs, input, output, plan, comp, no_combine(), budget, checkpoint);
+            output->clear();
+
+            merge_into_file<T>(runs, *input, plan, comp, no_combine(), budget, output_name, true);
+            if (!identify_file(output_name, manifest.file)) {
+                throw std::runtime_error("Can't open file " + output_name);
+            }
+            manifest.complete = true;
+            save_manifest(manifest_name, manifest, std::vector<run>());
+            rename_file(output_name, file_name);
+            first.persist(false);
+            second.persist(false);
+        }
+        std::remove(manifest_name.c_str());
+    }
+}
+
+// Sorts like external_sort, but survives a failure: a manifest next to file_name lists the runs after
+// run formation and after every merge pass, and a later call for the same file resumes from the last one.
+// The sorted data is written aside and renamed over file_name, so file_name always holds either the whole
+// input or the whole output. Merges keep the blocks they consume, so the scratch directories need up to
+// twice the size of the data.
+template<class T, class Comp>
+void resumable_external_sort(const std::string &file_name, unsigned long memory_size, unsigned long block_size,
+                             Comp comp, const sort_context &context = sort_context()) {
+    msort_detail::resumable_sort<T>(file_name, memory_size, block_size, comp, context);
+}
+
+
+namespace msort_detail {
+    // Sorts the elements of block files written by save_block as one sequence within memory_size bytes:
+    // every file is sorted as a run and copied into a scratch file of context, then the runs are merged
+    // with blocks of up to block_size bytes like by external_sort and passed to save by blocks of
+    // output_elements. The biggest file and an output block are held next to the merge. release is called
+    // once the memory is leased, so nothing is given up if the budget is too small; the files are kept.
+    template<class T, class Comp, class Release, class Save>
+    void sort_block_files(const std::vector<string> &files, unsigned long memory_size, unsigned long block_size,
+                          Comp comp, size_t output_elements, Release release, Save save,
+                          const sort_context &context) {
+        unsigned long size = 0, largest = output_elements * sizeof(T);
+        for (auto &file : files) {
+            size += get_raw_file_length(file);
+            largest = std::max<unsigned long>(largest, get_raw_file_length(file));
+        }
+        memory_budget budget(memory_size);
+        memory_budget::lease held = budget.acquire(largest * (std::is_trivially_copyable<T>::value ? 1 : 2));
+        const sort_plan plan = plan_sort<T>(size, budget.available(), block_size, 0, run_formation::chunks);
+        memory_budget::lease metadata = budget.acquire(run_metadata(size, plan.block_size));
+        release();
+        scratch_file first(context.scratch_names(), context.compress_runs()),
+                second(context.scratch_names(), context.compress_runs());
+        scratch_file *input = &first, *output = &second;
+
+        std::vector<run> runs;
+        std::vector<T> data;
+        const size_t elements = plan.block_size / sizeof(T);
+        for (auto &file : files) {
+            load_block(file, data);
+            if (!data.empty()) {
+                std::sort(data.begin(), data.end(), comp);
+                runs.emplace_back();
+                for (size_t position = 0; position < data.size(); position += elements) {
+                    size_t count = std::min(data.size() - position, elements);
+                    runs.back().push_back(input->allocate(runs.size() - 1, count, sizeof(T)));
+                    input->write(runs.back().back(), data.data() + position);
+                }
+            }
+        }
+        data = std::vector<T>();
+
+        merge_passes<T>(runs, input, output, plan, comp, no_combine(), budget);
+        output->clear();
+        run_merge<T, Comp, no_combine> merge(runs.data(), runs.data() + runs.size(), *input, comp, no_combine(),
+                                             budget, plan.block_size);
+        drain<T>(merge, output_elements, save);
+    }
+}
+
+// Priority queue far larger than memory, top() is the smallest element by comp. Pushes go to an in-memory
+// heap that is sorted and spilled as a run when it is full; runs are read back lazily, only the head block
+// of each one and the next being loaded are kept, and a heap of runs ordered by their heads merges them
+// with the insertion heap. When there are as many runs as blocks fit, the shorter half of them is merged
+// into one, so every element is rewritten about log(size / memory) times, like by an external sort.
+template<class T, class Comp = std::less<T>>
+class external_priority_queue {
+    struct spilled_run {
+        msort_detail::run blocks;
+        std::unique_ptr<msort_detail::run_reader<T>> reader;
+        unsigned long long left;
+    };
+
+    Comp comp;
+    msort_detail::memory_budget budget;
+    msort_detail::memory_budget::lease heap_memory, blocks_memory;
+    msort_detail::scratch_file scratch;
+    // outlives the readers of the runs
+    msort_detail::block_prefetcher<T> prefetcher;
+    size_t block_elements, capacity, max_runs, run_number = 0;
+    unsigned long long count = 0;
+    std::vector<T> heap;
+    // a heap by the head elements
+    std::vector<std::unique_ptr<spilled_run>> runs;
+
+    // both heaps keep the smallest element in front
+    auto heap_order() const {
+        return [this](const T &f, const T &s) {
+            return comp(s, f);
+        };
+    }
+
+    auto run_order() const {
+        return [this](const std::unique_ptr<spilled_run> &f, const std::unique_ptr<spilled_run> &s) {
+            return comp(*s->reader->head(), *f->reader->head());
+        };
+    }
+
+    bool runs_first() const;
+
+    void save(spilled_run &target, std::vector<T> &buffer);
+
+    void add_run(std::unique_ptr<spilled_run> &&spilled);
+
+    void spill();
+
+    void compact();
+
+public:
+    external_priority_queue(unsigned long memory_size, unsigned long block_size, Comp comp = Comp(),
+                            const sort_context &context = sort_context());
+
+    external_priority_queue(const external_priority_queue &) = delete;
+
+    void push(const T &object);
+
+    const T &top() const;
+
+    void pop();
+
+    unsigned long long size() const;
+
+    bool empty() const;
+};
+
+template<class T, class Comp>
+external_priority_queue<T, Comp>::external_priority_queue(unsigned long memory_size, unsigned long block_size,
+                                                          Comp comp, const sort_context &context)
+        : comp(comp), budget(memory_size), scratch(context.scratch_names(), context.compress_runs()) {
+    // the heap gets a quarter of memory, blocks of a 64th leave room for about 15 runs
+    unsigned long block = std::min(block_size, memory_size / 64);
+    block = std::max<unsigned long>(block - block % sizeof(T), sizeof(T));
+    const bool copied = msort_detail::copies_blocks<T>();
+    // every run holds two blocks, a spill or a merge fills one more and saves it with a header page
+    const unsigned long reader = block * (copied ? 3 : 2) + sizeof(spilled_run),
+            writer = block * (copied ? 2 : 1) + block_header::page_size;
+    block_elements = block / sizeof(T);
+    capacity = memory_size / 4 / sizeof(T);
+    const unsigned long rest = memory_size - capacity * sizeof(T);
+    max_runs = rest > writer ? (rest - writer) / reader : 0;
+    if (capacity == 0 || max_runs < 2) {
+        throw std::runtime_error("Can't fit a priority queue into memory budget of " +
+                                 std::to_string(memory_size) + " bytes");
+    }
+    heap_memory = budget.acquire(capacity * sizeof(T));
+    blocks_memory = budget.acquire(max_runs * reader + writer);
+    heap.reserve(capacity);
+}
+
+// whether the smallest element is the head of a run rather than the top of the insertion heap
+template<class T, class Comp>
+bool external_priority_queue<T, Comp>::runs_first() const {
+    return !runs.empty() && (heap.empty() || comp(*runs.front()->reader->head(), heap.front()));
+}
+
+// appends the buffer to the blocks of target as one block
+template<class T, class Comp>
+void external_priority_queue<T, Comp>::save(spilled_run &target, std::vector<T> &buffer) {
+    target.blocks.push_back(scratch.allocate(run_number, buffer.size(), sizeof(T)));
+    scratch.write(target.blocks.back(), buffer.data());
+    buffer.clear();
+}
+
+template<class T, class Comp>
+void external_priority_queue<T, Comp>::add_run(std::unique_ptr<spilled_run> &&spilled) {
+    ++run_number;
+    spilled->reader.reset(new msort_detail::run_reader<T>(spilled->blocks, scratch, prefetcher));
+    runs.push_back(std::move(spilled));
+    std::push_heap(runs.begin(), runs.end(), run_order());
+}
+
+template<class T, class Comp>
+void external_priority_queue<T, Comp>::spill() {
+    if (runs.size() == max_runs) {
+        compact();
+    }
+    std::sort(heap.begin(), heap.end(), comp);
+    std::unique_ptr<spilled_run> spilled(new spilled_run{msort_detail::run(), nullptr, heap.size()});
+    for (size_t position = 0; position < heap.size(); position += block_elements) {
+        size_t size = std::min(heap.size() - position, block_elements);
+        spilled->blocks.push_back(scratch.allocate(run_number, size, sizeof(T)));
+        scratch.write(spilled->blocks.back(), heap.data() + position);
+    }
+    heap.clear();
+    add_run(std::move(spilled));
+}
+
+// merges the shorter half of the runs from their current heads into a new run
+template<class T, class Comp>
+void external_priority_queue<T, Comp>::compact() {
+    const size_t fan_in = (runs.size() + 1) / 2;
+    std::nth_element(runs.begin(), runs.end() - fan_in, runs.end(), [](const std::unique_ptr<spilled_run> &f,
+                                                                       const std::unique_ptr<spilled_run> &s) {
+        return f->left > s->left;
+    });
+    std::vector<std::unique_ptr<spilled_run>> merged;
+    std::vector<const T *> heads;
+    for (auto it = runs.end() - fan_in; it != runs.end(); ++it) {
+        heads.push_back((*it)->reader->head());
+        merged.push_back(std::move(*it));
+    }
+    runs.resize(runs.size() - fan_in);
+    std::make_heap(runs.begin(), runs.end(), run_order());
+
+    std::unique_ptr<spilled_run> result(new spilled_run{msort_detail::run(), nullptr, 0});
+    msort_detail::loser_tree<T, Comp> tree(heads, comp);
+    std::vector<T> buffer;
+    buffer.reserve(block_elements);
+    for (const T *head; (head = tree.top()) != nullptr;) {
+        buffer.push_back(*head);
+        ++result->left;
+        tree.replace_top(merged[tree.winner()]->reader->advance());
+        if (buffer.size() == block_elements) {
+            save(*result, buffer);
+        }
+    }
+    if (!buffer.empty()) {
+        save(*result, buffer);
+    }
+    merged.clear();
+    add_run(std::move(result));
+}
+
+template<class T, class Comp>
+void external_priority_queue<T, Comp>::push(const T &object) {
+    if (heap.size() == capacity) {
+        spill();
+    }
+    heap.push_back(object);
+    std::push_heap(heap.begin(), heap.end(), heap_order());
+    ++count;
+}
+
+template<class T, class Comp>
+const T &external_priority_queue<T, Comp>::top() const {
+    if (count == 0) {
+        throw std::runtime_error("Can't take the top of an empty priority queue");
+    }
+    return runs_first() ? *runs.front()->reader->head() : heap.front();
+}
+
+template<class T, class Comp>
+void external_priority_queue<T, Comp>::pop() {
+    if (count == 0) {
+        throw std::runtime_error("Can't pop from an empty priority queue");
+    }
+    --count;
+    if (!runs_first()) {
+        std::pop_heap(heap.begin(), heap.end(), heap_order());
+        heap.pop_back();
+        return;
+    }
+    std::pop_heap(runs.begin(), runs.end(), run_order());
+    --runs.back()->left;
+    if (runs.back()->reader->advance() == nullptr) {
+        runs.pop_back();
+    } else {
+        std::push_heap(runs.begin(), runs.end(), run_order());
+    }
+}
+
+template<class T, class Comp>
+unsigned long long external_priority_queue<T, Comp>::size() const {
+    return count;
+}
+
+template<class T, class Comp>
+bool external_priority_queue<T, Comp>::empty() const {
+    return count == 0;
+}
+
 #endif //MERGESORT_MSORT_H
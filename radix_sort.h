@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef DEQUE_RADIX_SORT_H
+#define DEQUE_RADIX_SORT_H
+
+// Describes keys that radix_sort can handle: digits bytes, digit(key, 0) is the least significant one.
+template<class K, class Enable = void>
+struct radix_traits;
+
+template<class K>
+struct radix_traits<K, typename std::enable_if<std::is_integral<K>::value && !std::is_same<K, bool>::value>::type> {
+    using unsigned_type = typename std::make_unsigned<K>::type;
+    static constexpr size_t digits = sizeof(K);
+
+    // signed keys get the sign bit flipped, so negative numbers come first
+    static unsigned_type normalize(K key) {
+        return static_cast<unsigned_type>(key) ^
+               (std::is_signed<K>::value ? unsigned_type(1) << (8 * sizeof(K) - 1) : unsigned_type(0));
+    }
+
+    static unsigned digit(K key, size_t i) {
+        return (normalize(key) >> (8 * i)) & 0xff;
+    }
+
+    static bool less(K f, K s) {
+        return f < s;
+    }
+};
+
+template<class K>
+struct radix_traits<K, typename std::enable_if<std::is_floating_point<K>::value>::type> {
+    static_assert(sizeof(K) == sizeof(uint32_t) || sizeof(K) == sizeof(uint64_t), "unsupported floating point type");
+    using unsigned_type = typename std::conditional<sizeof(K) == sizeof(uint32_t), uint32_t, uint64_t>::type;
+    static constexpr size_t digits = sizeof(K);
+
+    // negative numbers have all bits flipped, positive ones only the sign bit
+    static unsigned_type normalize(K key) {
+        unsigned_type bits;
+        std::memcpy(&bits, &key, sizeof(K));
+        const unsigned_type sign = unsigned_type(1) << (8 * sizeof(K) - 1);
+        return (bits & sign) ? ~bits : bits | sign;
+    }
+
+    static unsigned digit(K key, size_t i) {
+        return (normalize(key) >> (8 * i)) & 0xff;
+    }
+
+    static bool less(K f, K s) {
+        return normalize(f) < normalize(s);
+    }
+};
+
+// fixed width byte strings, compared lexicographically
+template<size_t N>
+struct radix_traits<std::array<unsigned char, N>, void> {
+    static constexpr size_t digits = N;
+
+    static unsigned digit(const std::array<unsigned char, N> &key, size_t i) {
+        return key[N - 1 - i];
+    }
+
+    static bool less(const std::array<unsigned char, N> &f, const std::array<unsigned char, N> &s) {
+        return f < s;
+    }
+};
+
+template<class T, class Key>
+using radix_key = typename std::decay<decltype(std::declval<Key>()(std::declval<const T &>()))>::type;
+
+struct identity_key {
+    template<class T>
+    const T &operator()(const T &object) const {
+        return object;
+    }
+};
+
+// Stable LSD radix sort of data by key(element), one counting pass per key byte
+// using a scratch buffer of the same size. Bytes equal in all keys are skipped.
+template<class T, class Key>
+void radix_sort(std::vector<T> &data, Key key) {
+    using traits = radix_traits<radix_key<T, Key>>;
+    const size_t size = data.size();
+    if (size < 2) {
+        return;
+    }
+
+    std::vector<std::array<size_t, 256>> counts(traits::digits);
+    for (auto &count : counts) {
+        count.fill(0);
+    }
+    for (auto &element : data) {
+        auto &&current = key(element);
+        for (size_t i = 0; i < traits::digits; ++i) {
+            ++counts[i][traits::digit(current, i)];
+        }
+    }
+
+    std::vector<T> scratch(size);
+    for (size_t i = 0; i < traits::digits; ++i) {
+        auto &count = counts[i];
+        if (count[traits::digit(key(data.front()), i)] == size) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (auto &bucket : count) {
+            std::swap(bucket, offset);
+            offset += bucket;
+        }
+        for (auto &element : data) {
+            scratch[count[traits::digit(key(element), i)]++] = std::move(element);
+        }
+        data.swap(scratch);
+    }
+}
+
+// Order preserving prefix of a key: its eight most significant digits.
+// Keys of up to eight digits are equal if and only if their prefixes are.
+template<class K>
+uint64_t key_prefix(const K &key) {
+    using traits = radix_traits<K>;
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+        prefix <<= 8;
+        if (i < traits::digits) {
+            prefix |= traits::digit(key, traits::digits - 1 - i);
+        }
+    }
+    return prefix;
+}
+
+// Sorts data by key(element) without moving the elements during the sort: compact
+// (key prefix, index) pairs are sorted, whole keys are compared only on equal prefixes,
+// then every element is moved once. Meant for wide elements with short keys.
+template<class T, class Key>
+void prefix_sort(std::vector<T> &data, Key key) {
+    using traits = radix_traits<radix_key<T, Key>>;
+    struct entry {
+        uint64_t prefix;
+        size_t index;
+    };
+    std::vector<entry> entries;
+    entries.reserve(data.size());
+    for (size_t i = 0; i < data.size(); ++i) {
+        entries.push_back(entry{key_prefix(key(data[i])), i});
+    }
+    std::sort(entries.begin(), entries.end(), [&data, &key](const entry &f, const entry &s) {
+        if (f.prefix != s.prefix) {
+            return f.prefix < s.prefix;
+        }
+        return traits::digits > sizeof(uint64_t) && traits::less(key(data[f.index]), key(data[s.index]));
+    });
+
+    std::vector<T> sorted;
+    sorted.reserve(data.size());
+    for (auto &e : entries) {
+        sorted.push_back(std::move(data[e.index]));
+    }
+    data.swap(sorted);
+}
+
+#endif //DEQUE_RADIX_SORT_H
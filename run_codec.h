@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "util.h"
+
+#ifndef DEQUE_RUN_CODEC_H
+#define DEQUE_RUN_CODEC_H
+
+// Encodings of sorted runs: neighbours in a run are close, so each element is stored relative
+// to the previous one. id is recorded in the block header, 0 means raw elements and no encoding.
+// encode(data, count, out) stores the encoding in out and returns false if it isn't smaller
+// than the raw elements, decode(data, size, count, out) fills count elements.
+template<class T, class Enable = void>
+struct run_codec {
+    static constexpr uint32_t id = 0;
+};
+
+namespace {
+    const size_t max_varint_size = 10;
+
+    inline byte *put_varint(byte *out, uint64_t value) {
+        for (; value >= 0x80; value >>= 7) {
+            *(out++) = static_cast<byte>(value | 0x80);
+        }
+        *(out++) = static_cast<byte>(value);
+        return out;
+    }
+
+    inline const byte *get_varint(const byte *data, const byte *end, uint64_t &value) {
+        if (data != end && static_cast<unsigned char>(*data) < 0x80) {
+            value = static_cast<unsigned char>(*data);
+            return data + 1;
+        }
+        value = 0;
+        for (unsigned shift = 0; data != end && shift < 64; shift += 7) {
+            const uint64_t current = static_cast<unsigned char>(*data++);
+            value |= (current & 0x7f) << shift;
+            if (current < 0x80) {
+                return data;
+            }
+        }
+        throw std::runtime_error("Can't decode corrupted run block");
+    }
+}
+
+// integers wider than a byte: zigzag varints of the differences, one or two bytes each in a dense sorted run
+template<class K>
+struct run_codec<K, typename std::enable_if<std::is_integral<K>::value && (sizeof(K) > 1)>::type> {
+    using unsigned_type = typename std::make_unsigned<K>::type;
+    using signed_type = typename std::make_signed<K>::type;
+    static constexpr uint32_t id = 1;
+
+    static bool encode(const K *data, size_t count, std::vector<byte> &out) {
+        const size_t limit = count * sizeof(K);
+        out.resize(limit + max_varint_size);
+        byte *position = out.data();
+        unsigned_type previous = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const int64_t delta = static_cast<signed_type>(static_cast<unsigned_type>(data[i] - previous));
+            position = put_varint(position, (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+            if (static_cast<size_t>(position - out.data()) >= limit) {
+                return false;
+            }
+            previous = data[i];
+        }
+        out.resize(position - out.data());
+        return true;
+    }
+
+    static void decode(const byte *data, size_t size, size_t count, K *out) {
+        const byte *end = data + size;
+        unsigned_type previous = 0;
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t zigzag;
+            data = get_varint(data, end, zigzag);
+            previous += static_cast<unsigned_type>((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+            out[i] = static_cast<K>(previous);
+        }
+    }
+};
+
+// fixed width byte strings: the length of the prefix shared with the previous key, then the rest
+template<size_t N>
+struct run_codec<std::array<unsigned char, N>, void> {
+    static constexpr uint32_t id = 2;
+
+    static bool encode(const std::array<unsigned char, N> *data, size_t count, std::vector<byte> &out) {
+        const size_t limit = count * N;
+        out.resize(limit + max_varint_size + N);
+        byte *position = out.data();
+        for (size_t i = 0; i < count; ++i) {
+            size_t shared = 0;
+            if (i != 0) {
+                shared = std::mismatch(data[i - 1].begin(), data[i - 1].end(), data[i].begin()).first -
+                         data[i - 1].begin();
+            }
+            position = std::copy(data[i].begin() + shared, data[i].end(), put_varint(position, shared));
+            if (static_cast<size_t>(position - out.data()) >= limit) {
+                return false;
+            }
+        }
+        out.resize(position - out.data());
+        return true;
+    }
+
+    static void decode(const byte *data, size_t size, size_t count, std::array<unsigned char, N> *out) {
+        const byte *end = data + size;
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t shared;
+            data = get_varint(data, end, shared);
+            if (shared > N || (i == 0 && shared != 0) || static_cast<size_t>(end - data) < N - shared) {
+                throw std::runtime_error("Can't decode corrupted run block");
+            }
+            if (shared != 0) {
+                std::copy(out[i - 1].begin(), out[i - 1].begin() + shared, out[i].begin());
+            }
+            std::copy(data, data + (N - shared), out[i].begin() + shared);
+            data += N - shared;
+        }
+    }
+};
+
+namespace {
+    template<class T>
+    void write_encoded_block_at(int fd, size_t offset, const T *data, size_t count, std::false_type) {
+        write_block_at(fd, offset, data, count);
+    }
+
+    template<class T>
+    void write_encoded_block_at(int fd, size_t offset, const T *data, size_t count, std::true_type) {
+        std::vector<byte> encoded;
+        if (!run_codec<T>::encode(data, count, encoded)) {
+            write_block_at(fd, offset, data, count);
+            return;
+        }
+        auto &&head = block_head(encoded.data(), count, sizeof(T), run_codec<T>::id, encoded.size());
+        write_fully(fd, head.data(), head.size(), offset);
+        write_fully(fd, encoded.data(), encoded.size(), offset + head.size());
+    }
+
+    template<class T>
+    void read_encoded_block_at(int fd, size_t offset, size_t count, std::vector<T> &answer, std::false_type) {
+        read_block_at(fd, offset, count, answer);
+    }
+
+    // the header tells the codec and the size of the payload
+    template<class T>
+    void read_encoded_block_at(int fd, size_t offset, size_t count, std::vector<T> &answer, std::true_type) {
+        block_header header;
+        read_fully(fd, reinterpret_cast<byte *>(&header), sizeof(header), offset);
+        if (header.codec == 0) {
+            read_block_at(fd, offset, count, answer);
+            return;
+        }
+        if (header.codec != run_codec<T>::id || header.count != count) {
+            throw std::runtime_error("Can't decode run block of codec " + std::to_string(header.codec));
+        }
+        std::vector<byte> encoded(header.payload_size);
+        read_fully(fd, encoded.data(), encoded.size(), offset + header.payload_offset);
+        answer.resize(count);
+        run_codec<T>::decode(encoded.data(), encoded.size(), count, answer.data());
+    }
+}
+
+// Writes count elements as a block at offset like write_block_at, encoded by run_codec<T>
+// if compress is set and the encoding is smaller.
+template<class T>
+void write_run_block_at(int fd, size_t offset, const T *data, size_t count, bool compress) {
+    if (compress) {
+        write_encoded_block_at(fd, offset, data, count, std::integral_constant<bool, run_codec<T>::id != 0>());
+    } else {
+        write_block_at(fd, offset, data, count);
+    }
+}
+
+// reads a block written by write_run_block_at
+template<class T>
+void read_run_block_at(int fd, size_t offset, size_t count, std::vector<T> &answer) {
+    read_encoded_block_at(fd, offset, count, answer, std::integral_constant<bool, run_codec<T>::id != 0>());
+}
+
+#endif //DEQUE_RUN_CODEC_H
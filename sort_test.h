@@ -3,9 +3,13 @@
 #include "msort.h"
 #include <random>
 #include <fstream>
+#include <chrono>
+#include <map>
+#include <queue>
 
 namespace sort_test {
     const unsigned long long count = 1000000;
+    const unsigned long test_memory = 20 * 1024 * 1024, test_block = 2 * 1024 * 1024;
     unsigned long long size;
     string root;
     using std::cout;
@@ -26,9 +30,16 @@ namespace sort_test {
 
         fout.close();
 
+        auto vec4 = vec2, vec5 = vec2, vec6 = vec2;
         std::sort(vec1.begin(), vec1.end());
         merge_sort(vec2.begin(), vec2.end());
-        external_sort<int>(file_name, 1L, 1L);
+        adaptive_merge_sort(vec6.begin(), vec6.end());
+        assert(vec6 == vec1);
+        parallel_merge_sort(vec4.begin(), vec4.end(), std::less<int>(), 4, true);
+        parallel_merge_sort(vec5.begin(), vec5.end(), std::less<int>(), 4, false);
+        assert(vec4 == vec1);
+        assert(vec5 == vec1);
+        external_sort<int>(file_name, test_memory, test_block);
 
         auto vec3 = load_block<int>(file_name);
 
@@ -38,10 +49,532 @@ namespace sort_test {
             assert(vec3[i] == vec1[i]);
         }
 
+        save_block(file_name, vec1);
+        assert(verify_block(file_name));
+        assert(load_block<int>(file_name) == vec1);
+
+        // a flipped payload byte fails the checksum
+        {
+            std::fstream file(file_name, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(block_header::page_size + 7);
+            file.put(~vec1[1] >> 24);
+        }
+        assert(!verify_block(file_name));
+        bool rejected = false;
+        try {
+            load_block<int>(file_name);
+        } catch (std::runtime_error &) {
+            rejected = true;
+        }
+        assert(rejected);
+
+        remove(file_name.c_str());
+    }
+
+    // a disorder window far smaller than the heap never forces a new run, random input takes several
+    void test_replacement_selection(bool nearly_sorted) {
+        string file_name = root + "/replacement";
+        std::ofstream fout(file_name);
+        std::vector<int> vec;
+
+        for (int i = 0; i < 4 * count; ++i) {
+            vec.push_back(nearly_sorted ? i + rand() % 1000 : rand());
+            auto buf = to_bytes(vec.back());
+            fout.write(buf.data(), buf.size());
+        }
+        fout.close();
+
+        {
+            const msort_detail::sort_plan plan = msort_detail::plan_sort<int>(4 * count * sizeof(int), test_memory,
+                                                                              test_block, 0,
+                                                                              run_formation::replacement_selection);
+            msort_detail::memory_budget budget(test_memory);
+            msort_detail::scratch_file scratch({root + "/replacement_runs"});
+            auto runs = msort_detail::replacement_selection<int>(file_name, plan, std::less<int>(),
+                                                                 msort_detail::no_combine(), scratch, budget, false);
+            assert(nearly_sorted ? runs.size() == 1 : runs.size() > 1);
+        }
+
+        std::sort(vec.begin(), vec.end());
+        external_sort<int>(file_name, test_memory, test_block, run_formation::replacement_selection);
+        assert(load_block<int>(file_name) == vec);
+
+        remove(file_name.c_str());
+    }
+
+    // a budget twenty times smaller than the data takes several passes, a too small one is refused
+    void test_memory_budget() {
+        string file_name = root + "/budget";
+        std::ofstream fout(file_name);
+        std::vector<int> vec;
+        for (int i = 0; i < 5 * count; ++i) {
+            vec.push_back(rand());
+            auto buf = to_bytes(vec.back());
+            fout.write(buf.data(), buf.size());
+        }
+        fout.close();
+
+        std::sort(vec.begin(), vec.end());
+        external_sort<int>(file_name, 1024 * 1024, test_block, std::less<int>());
+        assert(load_block<int>(file_name) == vec);
+
+        bool refused = false;
+        try {
+            external_sort<int>(file_name, 64 * 1024, test_block, std::less<int>());
+        } catch (std::runtime_error &) {
+            refused = true;
+        }
+        assert(refused);
+
         remove(file_name.c_str());
     }
 
-    void test_external(unsigned long long block_size, unsigned long long cnt, const string &file_name) {
+    // ranks are selected in a budget far smaller than the data, the k smallest in one pass and through selection
+    void test_top_k() {
+        string file_name = root + "/top_k", output_name = root + "/top_k_output";
+        std::ofstream fout(file_name);
+        std::vector<int> vec;
+        for (int i = 0; i < 5 * count; ++i) {
+            vec.push_back(rand() % (10 * count));
+            auto buf = to_bytes(vec.back());
+            fout.write(buf.data(), buf.size());
+        }
+        fout.close();
+
+        std::sort(vec.begin(), vec.end());
+        for (size_t rank : {size_t(0), vec.size() / 3, vec.size() - 1}) {
+            assert(external_nth_element<int>(file_name, rank, 32 * 1024, test_block, std::less<int>()) == vec[rank]);
+        }
+        for (size_t k : {size_t(100), size_t(3 * count)}) {
+            external_top_k<int>(file_name, output_name, k, test_memory, test_block, std::less<int>());
+            assert(load_block<int>(output_name) == std::vector<int>(vec.begin(), vec.begin() + k));
+        }
+
+        remove(file_name.c_str());
+        remove(output_name.c_str());
+    }
+
+    // a frontier that grows, then moves forward like in Dijkstra's algorithm, then drains
+    void test_priority_queue() {
+        external_priority_queue<int> queue(1024 * 1024, test_block);
+        std::priority_queue<int, std::vector<int>, std::greater<int>> expected;
+        for (int i = 0; i < 2 * count; ++i) {
+            int value = rand() % (10 * count);
+            queue.push(value);
+            expected.push(value);
+        }
+        for (int i = 0; i < 2 * count; ++i) {
+            assert(queue.top() == expected.top());
+            int value = expected.top() + rand() % 1000;
+            queue.pop();
+            expected.pop();
+            queue.push(value);
+            expected.push(value);
+            if (i % 2 == 0) {
+                queue.push(value + 1);
+                expected.push(value + 1);
+            }
+        }
+        assert(queue.size() == expected.size());
+        for (; !expected.empty(); expected.pop()) {
+            assert(queue.top() == expected.top());
+            queue.pop();
+        }
+        assert(queue.empty());
+    }
+
+    // buckets that fit a worker's share, and files of few distinct elements that sampling can't split,
+    // the last ones with a budget too tight for a worker's share to hold them
+    void test_sample_sort() {
+        string file_name = root + "/sample_sort";
+        struct sample_case {
+            int distinct;
+            size_t size;
+            unsigned long memory_size;
+            size_t threads;
+        };
+        for (sample_case test : {sample_case{10 * int(count), 5 * count, 4 * 1024 * 1024, 4},
+                                 sample_case{1, 5 * count, 4 * 1024 * 1024, 4},
+                                 sample_case{2, 300000, 1024 * 1024, 3},
+                                 sample_case{1, 300000, 1024 * 1024, 3}}) {
+            std::ofstream fout(file_name);
+            std::vector<int> vec;
+            for (size_t i = 0; i < test.size; ++i) {
+                vec.push_back(rand() % test.distinct);
+                auto buf = to_bytes(vec.back());
+                fout.write(buf.data(), buf.size());
+            }
+            fout.close();
+
+            std::sort(vec.begin(), vec.end());
+            external_sample_sort<int>(file_name, test.memory_size, test_block, std::less<int>(), test.threads);
+            assert(load_block<int>(file_name) == vec);
+        }
+
+        remove(file_name.c_str());
+    }
+
+    template<class V>
+    void test_network() {
+        for (size_t n = 0; n <= network_limit; ++n) {
+            std::vector<V> vec;
+            for (size_t i = 0; i < n; ++i) {
+                vec.push_back(V(rand() % 100 - 50));
+            }
+            auto sorted = vec;
+            std::sort(sorted.begin(), sorted.end());
+            network_sort(vec.data(), vec.size());
+            assert(vec == sorted);
+        }
+    }
+
+    // -0.0 and 0.0 are equal and NaN is unordered, the network must keep every one of them
+    template<class V>
+    void test_network_special() {
+        auto bits = [](const std::vector<V> &vec) {
+            std::vector<std::string> answer;
+            for (V value : vec) {
+                answer.emplace_back(reinterpret_cast<const char *>(&value), sizeof(V));
+            }
+            std::sort(answer.begin(), answer.end());
+            return answer;
+        };
+        const V values[] = {V(-0.0), V(0.0), V(-1), V(1)};
+        for (size_t n = 1; n <= network_limit; ++n) {
+            for (bool nan : {false, true}) {
+                std::vector<V> vec;
+                for (size_t i = 0; i < n; ++i) {
+                    vec.push_back(values[rand() % 4]);
+                }
+                if (nan) {
+                    vec[rand() % n] = std::numeric_limits<V>::quiet_NaN();
+                }
+                auto expected = bits(vec);
+                network_sort(vec.data(), vec.size());
+                assert(bits(vec) == expected);
+                if (!nan) {
+                    assert(std::is_sorted(vec.begin(), vec.end()));
+                }
+            }
+        }
+    }
+
+    struct record {
+        std::array<unsigned char, 4> key;
+        int value;
+    };
+
+    void test_stream() {
+        string file_name = root + "/stream";
+        std::ofstream fout(file_name);
+        std::vector<int> vec;
+        external_sorter<int> sorter(test_memory, test_block);
+        for (int i = 0; i < 8 * count; ++i) {
+            vec.push_back(rand());
+            sorter.add(vec.back());
+            auto buf = to_bytes(vec.back());
+            fout.write(buf.data(), buf.size());
+        }
+        fout.close();
+        std::sort(vec.begin(), vec.end());
+
+        int object;
+        auto pushed = sorter.finish();
+        for (auto &expected : vec) {
+            assert(pushed.next(object) && object == expected);
+        }
+        assert(!pushed.next(object));
+
+        auto stream = external_sort_stream<int>(file_name, test_memory, test_block, std::less<int>());
+        for (auto &expected : vec) {
+            assert(stream.next(object) && object == expected);
+        }
+        assert(!stream.next(object));
+
+        remove(file_name.c_str());
+    }
+
+    // no runs at all: the merge has nothing to read and the output stays empty
+    void test_empty_input() {
+        string file_name = root + "/empty";
+        std::ofstream(file_name).close();
+        for (auto formation : {run_formation::chunks, run_formation::replacement_selection}) {
+            external_sort<int>(file_name, test_memory, test_block, std::less<int>(), formation);
+            assert(get_raw_file_length(file_name) == 0);
+        }
+
+        int object;
+        auto stream = external_sort_stream<int>(file_name, test_memory, test_block, std::less<int>());
+        assert(!stream.next(object));
+        external_sorter<int> sorter(test_memory, test_block);
+        auto pushed = sorter.finish();
+        assert(!pushed.next(object));
+
+        remove(file_name.c_str());
+    }
+
+    // two sorts at once, both striped over two scratch directories which are empty afterwards
+    void test_scratch_directories() {
+        const std::vector<string> directories = {root + "/scratch0", root + "/scratch1"};
+        for (auto &directory : directories) {
+            mkdir(directory.c_str(), 0755);
+        }
+        sort_context context(directories);
+        std::vector<std::vector<int>> expected(2);
+        std::vector<std::thread> sorts;
+        for (size_t i = 0; i < expected.size(); ++i) {
+            string file_name = root + "/striped" + std::to_string(i);
+            std::ofstream fout(file_name);
+            for (int j = 0; j < 8 * count; ++j) {
+                expected[i].push_back(rand());
+                auto buf = to_bytes(expected[i].back());
+                fout.write(buf.data(), buf.size());
+            }
+            fout.close();
+            std::sort(expected[i].begin(), expected[i].end());
+            sorts.emplace_back([file_name, &context]() {
+                external_sort<int>(file_name, test_memory, test_block, std::less<int>(), run_formation::chunks,
+                                   context);
+            });
+        }
+        for (size_t i = 0; i < sorts.size(); ++i) {
+            sorts[i].join();
+            string file_name = root + "/striped" + std::to_string(i);
+            assert(load_block<int>(file_name) == expected[i]);
+            remove(file_name.c_str());
+        }
+        for (auto &directory : directories) {
+            assert(rmdir(directory.c_str()) == 0);
+        }
+    }
+
+    // values follow a stretch of equal ones, so the encoding pays off
+    template<class V>
+    void test_codec(const std::vector<V> &values) {
+        std::vector<V> vec(100, V());
+        vec.insert(vec.end(), values.begin(), values.end());
+        std::vector<byte> encoded;
+        bool smaller = run_codec<V>::encode(vec.data(), vec.size(), encoded);
+        assert(smaller);
+        std::vector<V> decoded(vec.size());
+        run_codec<V>::decode(encoded.data(), encoded.size(), decoded.size(), decoded.data());
+        assert(decoded == vec);
+    }
+
+    // extreme differences survive the codecs, a dense sorted run shrinks to about a quarter,
+    // and sorts give the same result with runs compressed and input mapped or neither
+    void test_run_codec() {
+        std::vector<int> dense;
+        for (int i = 0; i < count; ++i) {
+            dense.push_back(rand() % (4 * count));
+        }
+        std::sort(dense.begin(), dense.end());
+        test_codec(dense);
+        std::vector<byte> encoded;
+        bool smaller = run_codec<int>::encode(dense.data(), dense.size(), encoded);
+        assert(smaller && encoded.size() < dense.size() * sizeof(int) / 3);
+
+        test_codec<int>({std::numeric_limits<int>::max(), std::numeric_limits<int>::min(), 0, -1, 1});
+        test_codec<int64_t>({std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max(), -5});
+        test_codec<int16_t>({32767, -32768, 0, -1});
+        test_codec<uint16_t>({65535, 0, 128, 127});
+        std::vector<std::array<unsigned char, 8>> keys(count / 10);
+        for (auto &key : keys) {
+            for (size_t i = 0; i < key.size(); ++i) {
+                key[i] = i < 4 ? rand() % 2 : rand();
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        test_codec(keys);
+
+        string file_name = root + "/codec";
+        for (bool optimized : {true, false}) {
+            std::ofstream fout(file_name);
+            std::vector<long long> vec;
+            for (int i = 0; i < 3 * count; ++i) {
+                vec.push_back(rand() % 1000 - 500);
+                auto buf = to_bytes(vec.back());
+                fout.write(buf.data(), buf.size());
+            }
+            fout.close();
+            std::sort(vec.begin(), vec.end());
+            external_sort<long long>(file_name, 2 * 1024 * 1024, test_block, std::less<long long>(),
+                                     run_formation::chunks, sort_context({root}, optimized, optimized));
+            assert(load_block<long long>(file_name) == vec);
+        }
+        remove(file_name.c_str());
+    }
+
+    // throws after limit comparisons, like a process killed in the middle of a sort
+    struct failing_less {
+        std::shared_ptr<std::atomic<size_t>> calls;
+        size_t limit;
+
+        bool operator()(int f, int s) const {
+            if (++*calls > limit) {
+                throw std::runtime_error("interrupted");
+            }
+            return f < s;
+        }
+    };
+
+    // a sort interrupted in its merge passes leaves the input whole and resumes from its manifest,
+    // nothing is left in the scratch directory afterwards
+    void test_resumable() {
+        const string file_name = root + "/resumable", directory = root + "/resumable_scratch";
+        mkdir(directory.c_str(), 0755);
+        const sort_context context({directory});
+        std::vector<int> vec;
+        for (int i = 0; i < 5 * count; ++i) {
+            vec.push_back(rand());
+        }
+        auto write_input = [&]() {
+            std::ofstream fout(file_name);
+            for (int x : vec) {
+                auto buf = to_bytes(x);
+                fout.write(buf.data(), buf.size());
+            }
+        };
+        auto sorted = vec;
+        std::sort(sorted.begin(), sorted.end());
+
+        write_input();
+        failing_less counting{std::make_shared<std::atomic<size_t>>(0), std::numeric_limits<size_t>::max()};
+        resumable_external_sort<int>(file_name, 1024 * 1024, test_block, counting, context);
+        assert(load_block<int>(file_name) == sorted);
+
+        write_input();
+        bool interrupted = false;
+        try {
+            failing_less failing{std::make_shared<std::atomic<size_t>>(0), *counting.calls * 4 / 5};
+            resumable_external_sort<int>(file_name, 1024 * 1024, test_block, failing, context);
+        } catch (std::runtime_error &) {
+            interrupted = true;
+        }
+        assert(interrupted);
+        assert(load_block<int>(file_name) == vec);
+        assert(get_raw_file_length(file_name + ".sortmanifest") != 0);
+
+        resumable_external_sort<int>(file_name, 1024 * 1024, test_block, std::less<int>(), context);
+        assert(load_block<int>(file_name) == sorted);
+        assert(get_raw_file_length(file_name + ".sortmanifest") == 0);
+        assert(rmdir(directory.c_str()) == 0);
+        remove(file_name.c_str());
+    }
+
+    struct wide_record {
+        std::array<unsigned char, 16> key;
+        int id;
+        char payload[180];
+    };
+
+    void test_records() {
+        string file_name = root + "/records";
+        std::ofstream fout(file_name);
+        std::vector<wide_record> records(count / 4);
+        for (int i = 0; i < records.size(); ++i) {
+            for (auto &c : records[i].key) {
+                c = (unsigned char) (rand() % 4);
+            }
+            records[i].id = i;
+            auto buf = to_bytes(records[i]);
+            fout.write(buf.data(), buf.size());
+        }
+        fout.close();
+
+        external_sort_records<wide_record>(file_name, test_memory, test_block,
+                                           [](const wide_record &r) { return r.key; });
+        auto result = load_block<wide_record>(file_name);
+        assert(result.size() == records.size());
+        std::vector<bool> seen(records.size());
+        for (size_t i = 0; i < result.size(); ++i) {
+            assert(i == 0 || !(result[i].key < result[i - 1].key));
+            assert(!seen[result[i].id] && result[i].key == records[result[i].id].key);
+            seen[result[i].id] = true;
+        }
+
+        remove(file_name.c_str());
+    }
+
+    struct counter {
+        int key;
+        long long total;
+    };
+
+    void test_combine(run_formation formation) {
+        string file_name = root + "/combine";
+        std::ofstream fout(file_name);
+        std::map<int, long long> totals;
+        for (int i = 0; i < 4 * count; ++i) {
+            counter c{rand() % 5000, rand() % 100};
+            totals[c.key] += c.total;
+            auto buf = to_bytes(c);
+            fout.write(buf.data(), buf.size());
+        }
+        fout.close();
+
+        external_sort_combine<counter>(file_name, test_memory, test_block, [](const counter &c) { return c.key; },
+                                       [](const counter &f, const counter &s) {
+                                           return counter{f.key, f.total + s.total};
+                                       }, formation);
+        auto result = load_block<counter>(file_name);
+        assert(result.size() == totals.size());
+        auto expected = totals.begin();
+        for (auto &c : result) {
+            assert(c.key == expected->first && c.total == expected->second);
+            ++expected;
+        }
+
+        remove(file_name.c_str());
+    }
+
+    void test_radix() {
+        std::vector<long long> numbers;
+        std::vector<record> records;
+        for (int i = 0; i < count; ++i) {
+            numbers.push_back((long long) rand() * (rand() % 2 ? 1 : -1) << (rand() % 32));
+            records.push_back(record{{(unsigned char) rand(), (unsigned char) rand(), (unsigned char) rand(), 0}, i});
+        }
+        auto sorted_numbers = numbers;
+        std::sort(sorted_numbers.begin(), sorted_numbers.end());
+        radix_sort(numbers, identity_key());
+        assert(numbers == sorted_numbers);
+
+        string file_name = root + "/radix";
+        std::ofstream fout(file_name);
+        std::vector<double> doubles;
+        for (int i = 0; i < count; ++i) {
+            doubles.push_back((rand() - RAND_MAX / 2) / 1000.0);
+            auto buf = to_bytes(doubles.back());
+            fout.write(buf.data(), buf.size());
+        }
+        fout.close();
+
+        std::sort(doubles.begin(), doubles.end());
+        external_sort<double>(file_name, test_memory, test_block);
+        assert(load_block<double>(file_name) == doubles);
+
+        fout.open(file_name);
+        for (auto &r : records) {
+            auto buf = to_bytes(r);
+            fout.write(buf.data(), buf.size());
+        }
+        fout.close();
+
+        // runs are merged stably, so the whole sort is stable
+        std::stable_sort(records.begin(), records.end(),
+                         [](const record &f, const record &s) { return f.key < s.key; });
+        external_sort_by_key<record>(file_name, test_memory, test_block, [](const record &r) { return r.key; });
+        auto result = load_block<record>(file_name);
+        for (int i = 0; i < count; ++i) {
+            assert(result[i].key == records[i].key && result[i].value == records[i].value);
+        }
+
+        remove(file_name.c_str());
+    }
+
+    void test_external(unsigned long long block_size, unsigned long long cnt, const string &file_name,
+                       bool sample = false) {
         int tmp;
         std::ofstream fout(file_name);
         for (unsigned long long i = 0; i < size; ++i) {
@@ -51,9 +584,16 @@ namespace sort_test {
         }
         fout.close();
         ++cnt;
-        auto start = clock();
-        external_sort<int>(file_name, block_size * cnt, block_size);
-        cout << "Done in " << (double) (clock() - start) / CLOCKS_PER_SEC << " seconds." << std::endl;
+        // wall time, the sort runs several threads
+        auto start = std::chrono::steady_clock::now();
+        if (sample) {
+            external_sample_sort<int>(file_name, block_size * cnt, block_size, std::less<int>());
+        } else {
+            external_sort<int>(file_name, block_size * cnt, block_size);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cout << "Done in " << seconds << " seconds, "
+             << (size * sizeof(int) / (1024.0 * 1024)) / seconds << " mb/s." << std::endl;
         remove(file_name.c_str());
     }
 
@@ -71,6 +611,24 @@ namespace sort_test {
         }
         cout << "------------------------\n";
 
+        cout << "------- parallel merge sort --------\n";
+        std::vector<int> data;
+        for (unsigned long long i = 0; i < size; ++i) {
+            data.push_back(rand());
+        }
+        for (bool use_buffer : {true, false}) {
+            cout << (use_buffer ? "With O(n) buffer\n" : "In place\n");
+            for (size_t threads = 1; threads <= std::max(1u, std::thread::hardware_concurrency()); threads *= 2) {
+                auto vec = data;
+                auto start = std::chrono::steady_clock::now();
+                parallel_merge_sort(vec.begin(), vec.end(), std::less<int>(), threads, use_buffer);
+                cout << "Threads: " << threads << ", done in "
+                     << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+                     << " seconds." << std::endl;
+            }
+        }
+        cout << "------------------------\n";
+
         const unsigned long long block_size = 4 * 1024 * 1024;
         cout << "Sort parameters: Block size = 4mb\n";
 
@@ -81,6 +639,36 @@ namespace sort_test {
 
         cout << "-------- External sort by ten blocks --------\n";
         test_external(block_size, 10, file_name);
+        cout << "--------------------------\n";
+
+        cout << "-------- External sample sort by ten blocks --------\n";
+        test_external(block_size, 10, file_name, true);
+    }
+
+    void test_adaptive() {
+        cout << "Data size: " << (float) (size * sizeof(int) / (1024 * 1024)) << " mb\n";
+        const std::vector<string> distributions = {"sorted", "reversed", "k-sorted", "random"};
+        for (size_t kind = 0; kind < distributions.size(); ++kind) {
+            std::vector<int> data;
+            for (unsigned long long i = 0; i < size; ++i) {
+                int values[] = {(int) i, (int) (size - i), (int) i + rand() % 64, rand()};
+                data.push_back(values[kind]);
+            }
+            cout << distributions[kind] << ":\n";
+            for (bool adaptive : {false, true}) {
+                auto vec = data;
+                auto start = std::chrono::steady_clock::now();
+                if (adaptive) {
+                    adaptive_merge_sort(vec.begin(), vec.end());
+                } else {
+                    merge_sort(vec.begin(), vec.end());
+                }
+                cout << (adaptive ? "  adaptive merge sort" : "  merge sort") << ", done in "
+                     << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+                     << " seconds." << std::endl;
+                assert(std::is_sorted(vec.begin(), vec.end()));
+            }
+        }
     }
 
     void test_diff_blocks_size() {
@@ -97,17 +685,61 @@ namespace sort_test {
         }
     }
 
+    // memory grows by doubling, plan_sort picks the block size and fan-in the merge actually uses
+    void test_fan_in() {
+        const unsigned long long block_size = 2 * 1024 * 1024;
+        cout << "Sort parameters: Block size up to 2mb\n";
+        const string file_name = root + "/fan_in";
+        for (unsigned long long blocks = 10; blocks <= 130; blocks = 2 * blocks - 2) {
+            const msort_detail::sort_plan plan = msort_detail::plan_sort<int>(size * sizeof(int),
+                                                                              block_size * (blocks + 1), block_size, 0,
+                                                                              run_formation::chunks);
+            cout << "Memory: " << block_size * (blocks + 1) / (1024 * 1024) << " mb, block size: "
+                 << plan.block_size / 1024 << " kb, fan-in: " << plan.fan_in << std::endl;
+            test_external(block_size, blocks, file_name);
+        }
+    }
+
     void sort_test(const string &dir_name, unsigned long long sz) {
         root = dir_name;
         size = sz;
         cout << "------- Correctness --------\n";
         test_correctness();
+        test_radix();
+        test_network<int32_t>();
+        test_network<int64_t>();
+        test_network<float>();
+        test_network<double>();
+        test_network_special<float>();
+        test_network_special<double>();
+        test_replacement_selection(false);
+        test_replacement_selection(true);
+        test_combine(run_formation::chunks);
+        test_stream();
+        test_empty_input();
+        test_records();
+        test_scratch_directories();
+        test_memory_budget();
+        test_top_k();
+        test_priority_queue();
+        test_sample_sort();
+        test_run_codec();
+        test_resumable();
+        test_combine(run_formation::replacement_selection);
         cout << "------- All correct --------\n";
 
         cout << "------- Performance --------\n";
         test_performance();
         cout << "-------   Done   --------\n";
 
+        cout << "------- Adaptive merge sort --------\n";
+        test_adaptive();
+        cout << "-------   Done   --------\n";
+
+        cout << "------- Merge fan-in --------\n";
+        test_fan_in();
+        cout << "-------   Done   --------\n";
+
         cout << "------- Different blocks count --------\n";
         //test_diff_blocks_size();
         cout << "------- Done --------\n";
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#ifndef DEQUE_SORTING_NETWORK_H
+#define DEQUE_SORTING_NETWORK_H
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define DEQUE_NETWORK_AVX2
+#define DEQUE_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Sorting kernel for up to network_limit primitive keys: every register is sorted
+// by a bitonic network, then registers are merged pairwise by a bitonic merge network.
+// AVX2 is picked at runtime, the fallback is a scalar insertion sort.
+namespace {
+    const long network_limit = 64;
+
+    template<class V>
+    struct is_network_key : std::integral_constant<bool, std::is_same<V, int32_t>::value ||
+                                                         std::is_same<V, int64_t>::value ||
+                                                         std::is_same<V, float>::value ||
+                                                         std::is_same<V, double>::value> {
+    };
+
+    template<class V, class Comp>
+    struct is_default_less : std::integral_constant<bool, std::is_same<Comp, std::less<V>>::value ||
+                                                          std::is_same<Comp, std::less<void>>::value> {
+    };
+
+    template<class V>
+    V network_padding() {
+        return std::numeric_limits<V>::has_infinity ? std::numeric_limits<V>::infinity()
+                                                    : std::numeric_limits<V>::max();
+    }
+
+    template<class V>
+    bool has_nan(const V *data, size_t size) {
+        return std::numeric_limits<V>::has_quiet_NaN &&
+               std::any_of(data, data + size, [](V value) { return value != value; });
+    }
+
+    template<class V>
+    void insertion_sort(V *data, size_t size) {
+        for (size_t i = 1; i < size; ++i) {
+            V current = data[i];
+            size_t j = i;
+            for (; j > 0 && current < data[j - 1]; --j) {
+                data[j] = data[j - 1];
+            }
+            data[j] = current;
+        }
+    }
+
+#ifdef DEQUE_NETWORK_AVX2
+    // One compare-exchange layer over a register viewed as eight 32-bit words:
+    // every lane is compared with its partner and takes the min or the max.
+    struct network_stage {
+        int32_t permutation[8];
+        int32_t take_max[8];
+    };
+
+    // bitonic sorter of a whole register, or only the final merger for bitonic input
+    inline std::vector<network_stage> bitonic_stages(size_t lanes, bool merge_only) {
+        std::vector<network_stage> stages;
+        const size_t words = 8 / lanes;
+        for (size_t k = merge_only ? lanes : 2; k <= lanes; k <<= 1) {
+            for (size_t j = k >> 1; j > 0; j >>= 1) {
+                network_stage stage;
+                for (size_t i = 0; i < lanes; ++i) {
+                    size_t partner = i ^ j;
+                    bool ascending = (i & k) == 0, lower = i < partner;
+                    for (size_t w = 0; w < words; ++w) {
+                        stage.permutation[i * words + w] = partner * words + w;
+                        stage.take_max[i * words + w] = lower != ascending ? -1 : 0;
+                    }
+                }
+                stages.push_back(stage);
+            }
+        }
+        return stages;
+    }
+
+    inline network_stage reverse_stage(size_t lanes) {
+        network_stage stage;
+        const size_t words = 8 / lanes;
+        for (size_t i = 0; i < lanes; ++i) {
+            for (size_t w = 0; w < words; ++w) {
+                stage.permutation[i * words + w] = (lanes - 1 - i) * words + w;
+                stage.take_max[i * words + w] = 0;
+            }
+        }
+        return stage;
+    }
+
+    template<class V>
+    DEQUE_AVX2 inline __m256i simd_load(const V *data) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+    }
+
+    template<class V>
+    DEQUE_AVX2 inline void simd_store(V *data, __m256i v) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(data), v);
+    }
+
+    // all ones in the lanes where a < b; compare-exchanges blend by one such mask, so that every lane
+    // takes exactly one of the two values even when they are equal (-0.0 and 0.0) or unordered
+    DEQUE_AVX2 inline __m256i simd_less(__m256i a, __m256i b, int32_t) {
+        return _mm256_cmpgt_epi32(b, a);
+    }
+
+    DEQUE_AVX2 inline __m256i simd_less(__m256i a, __m256i b, int64_t) {
+        return _mm256_cmpgt_epi64(b, a);
+    }
+
+    DEQUE_AVX2 inline __m256i simd_less(__m256i a, __m256i b, float) {
+        return _mm256_castps_si256(_mm256_cmp_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _CMP_LT_OQ));
+    }
+
+    DEQUE_AVX2 inline __m256i simd_less(__m256i a, __m256i b, double) {
+        return _mm256_castpd_si256(_mm256_cmp_pd(_mm256_castsi256_pd(a), _mm256_castsi256_pd(b), _CMP_LT_OQ));
+    }
+
+    template<class V>
+    DEQUE_AVX2 inline __m256i apply_stages(__m256i v, const std::vector<network_stage> &stages) {
+        for (auto &stage : stages) {
+            __m256i partner = _mm256_permutevar8x32_epi32(v, simd_load(stage.permutation));
+            __m256i take_partner = _mm256_blendv_epi8(simd_less(partner, v, V()), simd_less(v, partner, V()),
+                                                      simd_load(stage.take_max));
+            v = _mm256_blendv_epi8(v, partner, take_partner);
+        }
+        return v;
+    }
+
+    template<class V>
+    struct network_tables {
+        static constexpr size_t lanes = 32 / sizeof(V);
+        const std::vector<network_stage> sort = bitonic_stages(lanes, false), clean = bitonic_stages(lanes, true);
+        const network_stage reverse = reverse_stage(lanes);
+
+        static const network_tables &instance() {
+            static const network_tables tables;
+            return tables;
+        }
+    };
+
+    // merges two sorted registers: lo receives the smaller half, hi the bigger one, both sorted
+    template<class V>
+    DEQUE_AVX2 inline void merge_registers(__m256i a, __m256i b, __m256i &lo, __m256i &hi,
+                                           const network_tables<V> &tables) {
+        __m256i reversed = _mm256_permutevar8x32_epi32(b, simd_load(tables.reverse.permutation));
+        __m256i swap = simd_less(reversed, a, V());
+        lo = apply_stages<V>(_mm256_blendv_epi8(a, reversed, swap), tables.clean);
+        hi = apply_stages<V>(_mm256_blendv_epi8(reversed, a, swap), tables.clean);
+    }
+
+    // merges two sorted sequences of width elements (a multiple of the lane count) into out
+    template<class V>
+    DEQUE_AVX2 void merge_avx2(const V *a, const V *b, size_t width, V *out, const network_tables<V> &tables) {
+        const size_t lanes = network_tables<V>::lanes;
+        __m256i lo, hi;
+        merge_registers(simd_load(a), simd_load(b), lo, hi, tables);
+        simd_store(out, lo);
+        out += lanes;
+        for (size_t ia = lanes, ib = lanes; ia < width || ib < width; out += lanes) {
+            const V *next;
+            if (ib == width || (ia < width && a[ia] <= b[ib])) {
+                next = a + ia;
+                ia += lanes;
+            } else {
+                next = b + ib;
+                ib += lanes;
+            }
+            merge_registers(hi, simd_load(next), lo, hi, tables);
+            simd_store(out, lo);
+        }
+        simd_store(out, hi);
+    }
+
+    template<class V>
+    DEQUE_AVX2 void network_sort_avx2(V *data, size_t size) {
+        const auto &tables = network_tables<V>::instance();
+        const size_t lanes = network_tables<V>::lanes;
+        V first[network_limit], second[network_limit];
+        size_t padded = lanes;
+        while (padded < size) {
+            padded <<= 1;
+        }
+        std::copy(data, data + size, first);
+        std::fill(first + size, first + padded, network_padding<V>());
+
+        for (size_t i = 0; i < padded; i += lanes) {
+            simd_store(first + i, apply_stages<V>(simd_load(first + i), tables.sort));
+        }
+        V *from = first, *to = second;
+        for (size_t width = lanes; width < padded; width <<= 1) {
+            for (size_t start = 0; start < padded; start += width << 1) {
+                merge_avx2(from + start, from + start + width, width, to + start, tables);
+            }
+            std::swap(from, to);
+        }
+        std::copy(from, from + size, data);
+    }
+#endif
+
+    // sorts up to network_limit keys ascending; a NaN could trade places with the padding,
+    // so such input goes to the insertion sort
+    template<class V>
+    void network_sort(V *data, size_t size) {
+#ifdef DEQUE_NETWORK_AVX2
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        if (avx2 && !has_nan(data, size)) {
+            network_sort_avx2(data, size);
+            return;
+        }
+#endif
+        insertion_sort(data, size);
+    }
+
+    template<class T, class Comp>
+    bool small_sort(T, T, Comp &, std::false_type) {
+        return false;
+    }
+
+    template<class T, class Comp>
+    bool small_sort(T it_begin, T it_end, Comp &, std::true_type) {
+        network_sort(&*it_begin, it_end - it_begin);
+        return true;
+    }
+
+    // Sorts [it_begin, it_end) with the network if the keys are primitive, stored contiguously
+    // and compared by std::less; returns false if it can't.
+    template<class T, class Comp>
+    bool small_sort(T it_begin, T it_end, Comp &comp) {
+        using V = typename std::iterator_traits<T>::value_type;
+        using applicable = std::integral_constant<bool, is_network_key<V>::value && is_default_less<V, Comp>::value &&
+                                                        (std::is_pointer<T>::value ||
+                                                         std::is_same<T, typename std::vector<V>::iterator>::value)>;
+        return it_end - it_begin <= network_limit && small_sort(it_begin, it_end, comp, applicable());
+    }
+}
+
+#endif //DEQUE_SORTING_NETWORK_H
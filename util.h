@@ -1,10 +1,18 @@
 
 #include <array>
+#include <algorithm>
 #include <string>
 #include <fstream>
+#include <type_traits>
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
 #include <assert.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifndef DEQUE_UTIL_H
 #define DEQUE_UTIL_H
@@ -42,30 +50,6 @@ T &from_bytes(const array<byte, sizeof(T)> &data, T &object) {
     return object;
 }
 
-template<class T>
-T get_from_file(const string &file_name, size_t shift) {
-    std::ifstream fin(file_name, std::ios::binary);
-    fin.seekg(shift * sizeof(T), std::ios::beg);
-
-    std::array<byte, sizeof(T)> data;
-    fin.read(data.data(), sizeof(T));
-        //throw std::runtime_error("Can't read from file " + file_name);
-	fin.close();
-    //default constructor
-    T tmp;
-
-    return from_bytes(data, tmp);
-}
-
-template<class T>
-void add_to_file_end(const string &file_name, const T &object) {
-    auto data = to_bytes(object);
-	
-    std::ofstream fout(file_name, std::ios::out | std::ios::app);
-    fout.write(data.data(), data.size());
-    fout.close();
-}
-
 template<class T>
 size_t get_file_length(const string &file_name) {
     struct stat filestatus;
@@ -73,7 +57,7 @@ size_t get_file_length(const string &file_name) {
 	return filestatus.st_size / sizeof(T);
 }
 
-std::vector<byte> load_raw_block(const string &file_name) {
+inline std::vector<byte> load_raw_block(const string &file_name) {
     std::ifstream fin(file_name, std::ios::binary);
     struct stat filestatus;
     size_t size = 0;
@@ -91,40 +75,370 @@ std::vector<byte> load_raw_block(const string &file_name) {
     return vec;
 }
 
+inline size_t get_raw_file_length(const string &file_name) {
+    struct stat filestatus;
+    if (stat( file_name.c_str(), &filestatus ) != 0 ) {
+        return 0;
+    }
+    return filestatus.st_size;
+}
+
+// Blocks written by save_block start with this header, padded to a page,
+// so the elements can be mmapped by other processes and files verified without knowing T.
+// Files without the header are read as raw elements. A raw file whose first bytes happen to be
+// the signature is taken for a block, and load_block rejects it as corrupted since neither
+// the header fields nor the checksum match; such data has to be saved with save_block.
+struct block_header {
+    static constexpr uint64_t signature = 0x314b4c4251454444ULL; // "DDEQBLK1"
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t native_order = 0x01020304;
+    static constexpr uint64_t page_size = 4096;
+
+    uint64_t magic = signature;
+    uint32_t version = current_version;
+    uint32_t byte_order = native_order;
+    uint32_t element_size = 0;
+    uint32_t codec = 0; // 0 - raw elements
+    uint64_t count = 0;
+    uint64_t payload_offset = page_size;
+    uint64_t checksum = 0;
+    uint64_t payload_size = 0; // bytes of an encoded payload, unused by raw elements
+};
+
+// bytes the payload takes in the file
+inline uint64_t stored_payload_size(const block_header &header) {
+    return header.codec == 0 ? header.count * header.element_size : header.payload_size;
+}
+
+inline uint64_t block_checksum(const byte *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// length - bytes available from the start of the block
+inline void check_block_header(const block_header &header, const string &where, size_t length) {
+    if (header.version != block_header::current_version) {
+        throw std::runtime_error("Unsupported block version in " + where);
+    }
+    if (header.byte_order != block_header::native_order) {
+        throw std::runtime_error("Foreign byte order in " + where);
+    }
+    if (header.payload_offset + stored_payload_size(header) > length) {
+        throw std::runtime_error("Truncated block " + where);
+    }
+}
+
+// returns false for headerless files
+inline bool read_block_header(const string &file_name, block_header &header) {
+    size_t length = get_raw_file_length(file_name);
+    if (length < sizeof(block_header)) {
+        return false;
+    }
+    std::ifstream fin(file_name, std::ios::binary);
+    if (!fin.read(reinterpret_cast<byte *>(&header), sizeof(block_header)) || header.magic != block_header::signature) {
+        return false;
+    }
+
+    check_block_header(header, file_name, length);
+    return true;
+}
+
+// payload of a block as stored (the whole file if it has no header)
+inline std::vector<byte> load_block_payload(const string &file_name) {
+    block_header header;
+    if (!read_block_header(file_name, header)) {
+        return load_raw_block(file_name);
+    }
+    std::ifstream fin(file_name, std::ios::binary);
+    std::vector<byte> vec(stored_payload_size(header));
+    fin.seekg(header.payload_offset, std::ios::beg);
+    fin.read(vec.data(), vec.size());
+    fin.close();
+
+    return vec;
+}
+
+inline bool verify_block(const string &file_name) {
+    block_header header;
+    if (!read_block_header(file_name, header)) {
+        return false;
+    }
+    auto&& payload = load_block_payload(file_name);
+    return block_checksum(payload.data(), payload.size()) == header.checksum;
+}
+
+// Offset of the first element, header receives the header of the block;
+// the header of a raw file keeps no signature and counts the whole file.
 template <class T>
-std::vector<T> load_block(const string &file_name) {
-    auto&& vec = load_raw_block(file_name);
+size_t locate_payload(const string &file_name, block_header &header) {
+    if (!read_block_header(file_name, header)) {
+        header = block_header();
+        header.magic = 0;
+        header.count = get_raw_file_length(file_name) / sizeof(T);
+        return 0;
+    }
+    if (header.codec != 0) {
+        throw std::runtime_error("Can't locate elements of encoded block " + file_name);
+    }
+    if (header.element_size != sizeof(T)) {
+        throw std::runtime_error("Element size mismatch in " + file_name);
+    }
+    return header.payload_offset;
+}
+
+// throws if a loaded payload doesn't match the checksum of its block, raw files have none
+inline void check_payload(const block_header &header, const byte *data, size_t size, const string &file_name) {
+    if (header.magic == block_header::signature && block_checksum(data, size) != header.checksum) {
+        throw std::runtime_error("Checksum mismatch in block " + file_name);
+    }
+}
+
+// trivially copyable elements are read straight into the vector's storage
+template <class T>
+void load_block(const string &file_name, std::vector<T> &answer, std::true_type) {
+    block_header header;
+    size_t offset = locate_payload<T>(file_name, header);
+    std::ifstream fin(file_name, std::ios::binary);
+    answer.resize(header.count);
+    fin.seekg(offset, std::ios::beg);
+    if (!answer.empty() && !fin.read(reinterpret_cast<byte *>(answer.data()), answer.size() * sizeof(T))) {
+        throw std::runtime_error("Can't read from file " + file_name);
+    }
+    fin.close();
+    check_payload(header, reinterpret_cast<const byte *>(answer.data()), answer.size() * sizeof(T), file_name);
+}
+
+template <class T>
+void load_block(const string &file_name, std::vector<T> &answer, std::false_type) {
+    block_header header;
+    locate_payload<T>(file_name, header);
+    auto&& vec = load_block_payload(file_name);
+    check_payload(header, vec.data(), vec.size(), file_name);
     size_t counter = 0;
     std::array<byte, sizeof(T)> buffer;
-    std::vector<T> answer;
     T example;
 
+    answer.clear();
+    answer.reserve(header.count);
     while (counter < vec.size()) {
         for (auto iter = buffer.begin(); iter != buffer.end(); ++iter) {
             (*iter) = vec[counter++];
         }
         answer.push_back(from_bytes(buffer, example));
     }
+}
+
+// reads count elements from the current position of a stream
+template <class T>
+bool read_elements(std::istream &fin, size_t count, std::vector<T> &answer, std::true_type) {
+    answer.resize(count);
+    return static_cast<bool>(fin.read(reinterpret_cast<byte *>(answer.data()), count * sizeof(T)));
+}
+
+template <class T>
+bool read_elements(std::istream &fin, size_t count, std::vector<T> &answer, std::false_type) {
+    std::vector<byte> vec(count * sizeof(T));
+    if (!fin.read(vec.data(), vec.size())) {
+        return false;
+    }
+    std::array<byte, sizeof(T)> buffer;
+    T example;
+
+    answer.clear();
+    answer.reserve(count);
+    for (auto iter = vec.begin(); iter != vec.end(); iter += sizeof(T)) {
+        std::copy(iter, iter + sizeof(T), buffer.begin());
+        answer.push_back(from_bytes(buffer, example));
+    }
+    return true;
+}
+
+template <class T>
+bool read_elements(std::istream &fin, size_t count, std::vector<T> &answer) {
+    return read_elements(fin, count, answer, std::is_trivially_copyable<T>());
+}
+
+// replaces the content of answer, reusing its capacity
+template <class T>
+void load_block(const string &file_name, std::vector<T> &answer) {
+    load_block(file_name, answer, std::is_trivially_copyable<T>());
+}
+
+template <class T>
+std::vector<T> load_block(const string &file_name) {
+    std::vector<T> answer;
+    load_block(file_name, answer);
 
     return answer;
 }
 
+// header page of a block, data is the payload of stored_size bytes if it is encoded by codec
+inline std::vector<byte> block_head(const byte *data, size_t count, size_t element_size, uint32_t codec = 0,
+                                    size_t stored_size = 0) {
+    block_header header;
+    header.element_size = element_size;
+    header.codec = codec;
+    header.count = count;
+    header.payload_size = codec == 0 ? 0 : stored_size;
+    header.checksum = block_checksum(data, stored_payload_size(header));
+    std::vector<byte> head(header.payload_offset, 0);
+    std::memcpy(head.data(), &header, sizeof(header));
+
+    return head;
+}
+
+inline void save_block_payload(const string& file_name, const byte *data, size_t count, size_t element_size) {
+    auto&& head = block_head(data, count, element_size);
+
+    std::ofstream fout(file_name, std::ios::out | std::ios::binary);
+    fout.write(head.data(), head.size());
+    fout.write(data, count * element_size);
+    fout.close();
+}
+
+// byte image of count elements, storage is used only when T isn't trivially copyable
 template <class T>
-void save_block(const string& file_name, const std::vector<T>& data) {
-    std::vector<byte> raw_data;
+const byte *raw_elements(const T *data, size_t, std::vector<byte> &, std::true_type) {
+    return reinterpret_cast<const byte *>(data);
+}
 
-    std::for_each(data.begin(), data.end(),
-                  [&raw_data](const T& it){
+template <class T>
+const byte *raw_elements(const T *data, size_t count, std::vector<byte> &storage, std::false_type) {
+    storage.clear();
+    storage.reserve(count * sizeof(T));
+
+    std::for_each(data, data + count,
+                  [&storage](const T& it){
                       auto&& buffer = to_bytes(it);
-                      for (auto iter = buffer.begin(); iter != buffer.end(); ++iter) {
-                          raw_data.push_back(*iter);
-                      }
+                      storage.insert(storage.end(), buffer.begin(), buffer.end());
                   });
+    return storage.data();
+}
 
-    std::ofstream fout(file_name, std::ios::out);
-    fout.write(raw_data.data(), raw_data.size());
-    fout.close();
+template <class T>
+const byte *raw_elements(const std::vector<T> &data, std::vector<byte> &storage) {
+    return raw_elements(data.data(), data.size(), storage, std::is_trivially_copyable<T>());
+}
+
+template <class T>
+void save_block(const string& file_name, const std::vector<T>& data) {
+    std::vector<byte> storage;
+    save_block_payload(file_name, raw_elements(data, storage), data.size(), sizeof(T));
+}
 
+inline void write_fully(int fd, const byte *data, size_t size, size_t offset) {
+    while (size > 0) {
+        auto written = pwrite(fd, data, size, offset);
+        if (written <= 0) {
+            throw std::runtime_error("Can't write to descriptor " + std::to_string(fd));
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+inline void read_fully(int fd, byte *data, size_t size, size_t offset) {
+    while (size > 0) {
+        auto count = pread(fd, data, size, offset);
+        if (count <= 0) {
+            throw std::runtime_error("Can't read from descriptor " + std::to_string(fd));
+        }
+        data += count;
+        size -= count;
+        offset += count;
+    }
+}
+
+// Blocks can also be stored one after another inside a bigger file,
+// each one takes a page aligned extent starting with its header.
+inline size_t block_extent_size(size_t count, size_t element_size) {
+    const size_t page = block_header::page_size;
+    return page + (count * element_size + page - 1) / page * page;
+}
+
+template <class T>
+void write_block_at(int fd, size_t offset, const T *data, size_t count) {
+    std::vector<byte> storage;
+    auto raw = raw_elements(data, count, storage, std::is_trivially_copyable<T>());
+    auto&& head = block_head(raw, count, sizeof(T));
+    write_fully(fd, head.data(), head.size(), offset);
+    write_fully(fd, raw, count * sizeof(T), offset + head.size());
+}
+
+template <class T>
+void write_block_at(int fd, size_t offset, const std::vector<T> &data) {
+    write_block_at(fd, offset, data.data(), data.size());
+}
+
+// count - number of elements, as recorded when the block was written
+template <class T>
+void read_block_at(int fd, size_t offset, size_t count, std::vector<T> &answer, std::true_type) {
+    answer.resize(count);
+    read_fully(fd, reinterpret_cast<byte *>(answer.data()), count * sizeof(T), offset + block_header::page_size);
+}
+
+template <class T>
+void read_block_at(int fd, size_t offset, size_t count, std::vector<T> &answer, std::false_type) {
+    std::vector<byte> vec(count * sizeof(T));
+    read_fully(fd, vec.data(), vec.size(), offset + block_header::page_size);
+    std::array<byte, sizeof(T)> buffer;
+    T example;
+
+    answer.clear();
+    answer.reserve(count);
+    for (auto iter = vec.begin(); iter != vec.end(); iter += sizeof(T)) {
+        std::copy(iter, iter + sizeof(T), buffer.begin());
+        answer.push_back(from_bytes(buffer, example));
+    }
+}
+
+template <class T>
+void read_block_at(int fd, size_t offset, size_t count, std::vector<T> &answer) {
+    read_block_at(fd, offset, count, answer, std::is_trivially_copyable<T>());
+}
+
+// elements without a header, as in the files being sorted
+template <class T>
+void write_elements_at(int fd, size_t offset, const std::vector<T> &data) {
+    std::vector<byte> storage;
+    write_fully(fd, raw_elements(data, storage), data.size() * sizeof(T), offset);
+}
+
+// element number index of a file of raw elements
+template <class T>
+T read_element_at(int fd, size_t index) {
+    array<byte, sizeof(T)> data;
+    read_fully(fd, data.data(), data.size(), index * sizeof(T));
+    T object;
+    return from_bytes(data, object);
+}
+
+// calls visit(element) for every element of a file of raw elements, reading block_size bytes at a time
+template <class T, class F>
+void scan_elements(const string &file_name, size_t block_size, F visit) {
+    std::ifstream fin(file_name, std::ios::binary);
+    const size_t count = std::max<size_t>(1, block_size / sizeof(T));
+    std::vector<T> block;
+    for (size_t left = get_raw_file_length(file_name) / sizeof(T); left > 0;) {
+        size_t current = std::min(left, count);
+        if (!read_elements(fin, current, block)) {
+            throw std::runtime_error("Can't read from file " + file_name);
+        }
+        for (auto &object : block) {
+            visit(object);
+        }
+        left -= current;
+    }
 }
 
 template<class T>
@@ -154,6 +468,130 @@ void remove_from_file(const string &file_name, bool from_end) {
 }
 
 
+template<class T>
+void write_to_descriptor(int fd, size_t shift, const T &object) {
+    auto data = to_bytes(object);
+    if (pwrite(fd, data.data(), sizeof(T), shift * sizeof(T)) != sizeof(T)) {
+        throw std::runtime_error("Can't write to descriptor " + std::to_string(fd));
+    }
+}
+
+// Read-ahead window over an open descriptor: sequential access in either direction
+// costs one pread per window instead of one per element.
+template<class T>
+class buffered_reader {
+    static constexpr size_t window = (64 * 1024 + sizeof(T) - 1) / sizeof(T);
+    int fd;
+    size_t begin = 0, count = 0;
+    std::vector<byte> buffer;
+
+public:
+    explicit buffered_reader(int fd) : fd(fd) {}
+
+    T read(size_t shift) {
+        if (shift < begin || shift >= begin + count) {
+            if (shift >= begin) {
+                begin = shift;
+            } else {
+                // moving backwards: keep the window ending at shift
+                begin = shift + 1 > window ? shift + 1 - window : 0;
+            }
+            buffer.resize(window * sizeof(T));
+            auto bytes = pread(fd, buffer.data(), buffer.size(), begin * sizeof(T));
+            count = bytes < 0 ? 0 : bytes / sizeof(T);
+            if (shift >= begin + count) {
+                throw std::runtime_error("Can't read from descriptor " + std::to_string(fd));
+            }
+        }
+        std::array<byte, sizeof(T)> data;
+        auto from = buffer.begin() + (shift - begin) * sizeof(T);
+        std::copy(from, from + sizeof(T), data.begin());
+        T tmp;
+
+        return from_bytes(data, tmp);
+    }
+};
+
+// Sequential reader of a file of raw elements. With mapped set and trivially copyable elements the file
+// is mapped for sequential access: a read is a single copy out of the page cache, without zeroing
+// the vector first, and the pages are dropped from the mapping once copied. Otherwise it reads a stream.
+template<class T>
+class element_reader {
+    std::ifstream fin;
+    const byte *mapping = nullptr;
+    size_t length = 0, position = 0, released = 0;
+
+    bool read(size_t count, std::vector<T> &answer, std::true_type) {
+        const size_t bytes = count * sizeof(T);
+        if (position + bytes > length) {
+            return false;
+        }
+        // copied by pieces, so only a piece of mapped pages is resident at a time
+        const size_t piece = std::max<size_t>(1, (1 << 20) / sizeof(T));
+        answer.clear();
+        answer.reserve(count);
+        for (size_t done = 0; done < count; done += piece) {
+            const T *first = reinterpret_cast<const T *>(mapping + position) + done;
+            answer.insert(answer.end(), first, first + std::min(piece, count - done));
+            const size_t consumed = (position + answer.size() * sizeof(T)) / block_header::page_size *
+                                    block_header::page_size;
+            if (consumed > released) {
+                madvise(const_cast<byte *>(mapping) + released, consumed - released, MADV_DONTNEED);
+                released = consumed;
+            }
+        }
+        position += bytes;
+        return true;
+    }
+
+    bool read(size_t count, std::vector<T> &answer, std::false_type) {
+        return read_elements(fin, count, answer);
+    }
+
+public:
+    element_reader(const string &file_name, bool mapped) {
+        length = get_raw_file_length(file_name);
+        if (mapped && std::is_trivially_copyable<T>::value && length != 0) {
+            int fd = open(file_name.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Can't open file " + file_name);
+            }
+            void *address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (address == MAP_FAILED) {
+                throw std::runtime_error("Can't map file " + file_name);
+            }
+            mapping = static_cast<const byte *>(address);
+            madvise(address, length, MADV_SEQUENTIAL);
+        } else {
+            fin.open(file_name, std::ios::binary);
+        }
+    }
+
+    element_reader(const element_reader &) = delete;
+
+    // replaces the content of answer with the next count elements, false if the file is shorter
+    bool read(size_t count, std::vector<T> &answer) {
+        if (mapping != nullptr) {
+            return read(count, answer, std::is_trivially_copyable<T>());
+        }
+        return read(count, answer, std::false_type());
+    }
+
+    ~element_reader() {
+        if (mapping != nullptr) {
+            munmap(const_cast<byte *>(mapping), length);
+        }
+    }
+};
+
+// releases disk space of [offset, offset + length) without changing the file size,
+// falls back to doing nothing where hole punching is unsupported
+inline void punch_hole(int fd, size_t offset, size_t length) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+#endif
+}
 
 
 #endif //DEQUE_UTIL_H